@@ -0,0 +1,92 @@
+/*
+ * Benchmark frame_brightness() against previous rgb_frame_brightness() implementation.
+ * Build with -DBUILD_BENCHMARKS=ON, then run ./frame_bench [iterations].
+ */
+
+#include <frame_utils.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static const struct {
+    const char *name;
+    int width;
+    int height;
+} sizes[] = {
+    { "1080p", 1920, 1080 },
+    { "4K", 3840, 2160 },
+    { "8K", 7680, 4320 },
+};
+
+/*
+ * Previous implementation: column major traversal, 32bpp only, int accumulators.
+ * Note that it used pixel indexes as byte offsets, thus only sampling left quarter of each row.
+ */
+static int legacy_frame_brightness(const uint8_t *data, const int width, const int height, const int stride) {
+    int r = 0, g = 0, b = 0;
+    const int div = 8;
+    const int wmax = (double)width / div;
+    const int hmax = (double)height / div;
+    for (int i = 0; i < wmax; i++) {
+        for (int k = 0; k < hmax; k++) {
+            const uint8_t *p = data + (i * div + k * div * stride);
+            r += p[2] & 0xFF;
+            g += p[1] & 0xFF;
+            b += p[0] & 0xFF;
+        }
+    }
+    const int area = wmax * hmax;
+    r = (double)r / area;
+    g = (double)g / area;
+    b = (double)b / area;
+    return 0.299 * r + 0.587 * g + 0.114 * b;
+}
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+int main(int argc, char *argv[]) {
+    const int iterations = argc > 1 ? atoi(argv[1]) : 50;
+    
+    printf("%-6s %-16s %12s %8s\n", "size", "kernel", "us/frame", "value");
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(*sizes); s++) {
+        const int stride = sizes[s].width * 4;
+        uint8_t *data = malloc((size_t)stride * sizes[s].height);
+        if (!data) {
+            return EXIT_FAILURE;
+        }
+        srand(s);
+        for (size_t i = 0; i < (size_t)stride * sizes[s].height; i++) {
+            data[i] = rand();
+        }
+        
+        frame_t f = { data, sizes[s].width, sizes[s].height, stride, FRAME_XRGB8888 };
+        const struct {
+            const char *name;
+            int xstep;
+            int ystep;
+        } kernels[] = {
+            { "legacy", 0, 0 },
+            { "grid 8x8", 8, 8 },
+            { "default", FRAME_DEF_XSTEP, FRAME_DEF_YSTEP },
+        };
+        
+        for (size_t k = 0; k < sizeof(kernels) / sizeof(*kernels); k++) {
+            int val = 0;
+            const double start = now_us();
+            for (int i = 0; i < iterations; i++) {
+                if (kernels[k].xstep == 0) {
+                    val = legacy_frame_brightness(data, f.width, f.height, stride);
+                } else {
+                    val = frame_brightness(&f, kernels[k].xstep, kernels[k].ystep, NULL);
+                }
+            }
+            printf("%-6s %-16s %12.1f %8d\n", sizes[s].name, kernels[k].name, (now_us() - start) / iterations, val);
+        }
+        free(data);
+    }
+    return EXIT_SUCCESS;
+}
@@ -25,5 +25,17 @@
 #define WRONG_PLUGIN            INT_MIN + 1
 #define COMPOSITOR_NO_PROTOCOL  INT_MIN + 2
 
+/*
+ * Published by backlight on external monitors backlight changes,
+ * used by gamma to dim the output while slow DDC writes catch up.
+ */
+#define DDC_BL_TOPIC            "ddc-backlight"
+
+typedef struct {
+    char output[32];            // drm connector driving the monitor, eg: DP-1
+    double curr_pct;            // monitor backlight level
+    double target_pct;          // backlight level being reached
+} ddc_bl_msg;
+
 extern sd_bus *bus;
 extern struct udev *udev;
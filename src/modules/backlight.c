@@ -6,6 +6,7 @@
 #ifdef DDC_PRESENT
 
 #include <ddcutil_c_api.h>
+#include <dirent.h>
 
 /* Default value */
 static DDCA_Vcp_Feature_Code br_code = 0x10;
@@ -36,6 +37,7 @@ static void bl_load_vpcode(void) {
             if (!ddca_get_any_vcp_value_using_explicit_type(dh, br_code, DDCA_NON_TABLE_VCP_VALUE, &valrec)) { \
                 char id[32]; \
                 get_info_id(id, sizeof(id), dinfo); \
+                store_ddc_bus(id, dinfo); \
                 func; \
                 ddca_free_any_vcp_value(valrec); \
             } \
@@ -90,6 +92,19 @@ end: \
         }
     }
     
+    /* Remember i2c bus of each monitor, to find the drm connector driving it */
+    static map_t *ddc_buses;
+    
+    static void store_ddc_bus(const char *id, const DDCA_Display_Info *dinfo) {
+        if (ddc_buses && dinfo->path.io_mode == DDCA_IO_I2C && !map_has_key(ddc_buses, id)) {
+            int *busno = malloc(sizeof(int));
+            if (busno) {
+                *busno = dinfo->path.path.i2c_busno;
+                map_put(ddc_buses, id, busno);
+            }
+        }
+    }
+    
     static DDCA_Status convert_sn_to_id(const char *sn, DDCA_Display_Identifier *pdid) {
         int id1, id2;
         if (sscanf(sn, "/dev/i2c-%d", &id1) == 1) {
@@ -126,9 +141,21 @@ typedef struct {
     int smooth_fd;
     device d;
     double verse;
+    bool announced;             // external monitor change was published on DDC_BL_TOPIC
+    bool deferred;              // first DDC write was deferred after announcing the change
+    double ddc_target;          // external monitor backlight level being reached
+    char output[32];            // drm connector driving external monitor, if found
 } smooth_client;
 
+#ifdef DDC_PRESENT
+
+static int get_ddc_connector(const char *sn, char *name, const size_t size);
+static void publish_ddc_backlight(const smooth_client *sc, const double curr_pct);
+
+#endif
+
 /* Helpers */
+static void relax_ddc_backlight(smooth_client *sc);
 static void dtor_client(void *client);
 static void reset_backlight_struct(smooth_client *sc, double target_pct, bool is_smooth, double smooth_step, 
                                    unsigned int smooth_wait, int verse);
@@ -190,6 +217,7 @@ static bool evaluate(void) {
 static void init(void) {
 #ifdef DDC_PRESENT
     bl_load_vpcode();
+    ddc_buses = map_new(true, free);
 #endif
     running_clients = map_new(false, dtor_client);
     int r = sd_bus_add_object_vtable(bus,
@@ -219,13 +247,20 @@ static void receive(const msg_t *msg, const void *userdata) {
                 // error: it was not an internal backlight interface
                 if (ret == -1) {
                     // try to use it as external backlight sn
-                    set_external_backlight(sc);
+                    if (set_external_backlight(sc) == -1) {
+                        relax_ddc_backlight(sc);
+                    }
                 }
             }
             if (!sc->d.reached_target) {
                 struct itimerspec timerValue = {{0}};
                 timerValue.it_value.tv_sec = sc->smooth_wait / 1000;
                 timerValue.it_value.tv_nsec = 1000 * 1000 * (sc->smooth_wait % 1000); // ms
+                if (sc->smooth_wait == 0 || sc->deferred) {
+                    /* Immediately, eg: deferred DDC write after announcing the change */
+                    timerValue.it_value.tv_sec = 0;
+                    timerValue.it_value.tv_nsec = 1;
+                }
                 timerfd_settime(sc->smooth_fd, 0, &timerValue, NULL);
             } else {
                 m_log("%s reached target backlight: %s%.2lf.\n", sc->d.sn, sc->verse > 0 ? "+" : (sc->verse < 0 ? "-" : ""), sc->target_pct);
@@ -248,11 +283,25 @@ static void receive(const msg_t *msg, const void *userdata) {
 
 static void destroy(void) {
     map_free(running_clients);
+#ifdef DDC_PRESENT
+    map_free(ddc_buses);
+#endif
     udev_monitor_unref(mon);
 }
 
+/* Let gamma stop dimming an output whose DDC backlight change got stopped or replaced */
+static void relax_ddc_backlight(smooth_client *sc) {
+#ifdef DDC_PRESENT
+    if (strlen(sc->output)) {
+        publish_ddc_backlight(sc, sc->ddc_target);
+        sc->output[0] = '\0';
+    }
+#endif
+}
+
 static void dtor_client(void *client) {
     smooth_client *sc = (smooth_client *)client;
+    relax_ddc_backlight(sc);
     /* Free all resources */
     m_deregister_fd(sc->smooth_fd); // this will automatically close it!
     free(sc->d.sn);
@@ -265,6 +314,9 @@ static void reset_backlight_struct(smooth_client *sc, double target_pct, bool is
     sc->smooth_wait = is_smooth ? smooth_wait : 0;
     sc->target_pct = target_pct;
     sc->verse = verse;
+    relax_ddc_backlight(sc);
+    sc->announced = false;
+    sc->deferred = false;
     
     /* Only if not already there */
     if (sc->smooth_fd == 0) {
@@ -412,19 +464,106 @@ static int set_internal_backlight(smooth_client *sc) {
 static int set_external_backlight(smooth_client *sc) {
     int ret = -1;
 
+    sc->deferred = false;
     DDCUTIL_FUNC(sc->d.sn, {
         const uint16_t max = VALREC_MAX_VAL(valrec);
         const uint16_t curr = VALREC_CUR_VAL(valrec);
-        int16_t new_value = next_backlight_level(sc, curr, max) * max;
-        int8_t new_sh = new_value >> 8;
-        int8_t new_sl = new_value & 0xff;
-        if (new_value >= 0 && ddca_set_non_table_vcp_value(dh, br_code, new_sh, new_sl) == 0) {
-            ret = 0;
+        if (!sc->announced) {
+            sc->announced = true;
+            sc->ddc_target = sc->verse != 0 ? (double)curr / max + sc->verse * sc->target_pct : sc->target_pct;
+            sanitize_target_step(&sc->ddc_target, NULL);
+            if (get_ddc_connector(sc->d.sn, sc->output, sizeof(sc->output)) == 0) {
+                /*
+                 * Let gamma dim the output right away:
+                 * first (slow) DDC write is deferred to next tick.
+                 */
+                publish_ddc_backlight(sc, (double)curr / max);
+                sc->deferred = true;
+                ret = 0;
+            }
+        }
+        if (!sc->deferred) {
+            int16_t new_value = next_backlight_level(sc, curr, max) * max;
+            int8_t new_sh = new_value >> 8;
+            int8_t new_sl = new_value & 0xff;
+            if (new_value >= 0 && ddca_set_non_table_vcp_value(dh, br_code, new_sh, new_sl) == 0) {
+                ret = 0;
+                if (strlen(sc->output)) {
+                    /* Let gamma relax back as monitor catches up */
+                    publish_ddc_backlight(sc, sc->d.reached_target ? sc->ddc_target : (double)new_value / max);
+                }
+            }
         }
     });
     return ret;
 }
 
+#ifdef DDC_PRESENT
+
+/*
+ * Find drm connector whose i2c bus is the monitor one:
+ * DP aux adapters are children of the connector, others are linked as its "ddc".
+ */
+static int get_ddc_connector(const char *sn, char *name, const size_t size) {
+    int busno;
+    if (sscanf(sn, "/dev/i2c-%d", &busno) != 1) {
+        int *b = map_get(ddc_buses, sn);
+        if (!b) {
+            return -ENOENT;
+        }
+        busno = *b;
+    }
+    
+    DIR *d = opendir("/sys/class/drm");
+    if (!d) {
+        return -errno;
+    }
+    
+    int ret = -ENOENT;
+    char i2c[32];
+    snprintf(i2c, sizeof(i2c), "i2c-%d", busno);
+    struct dirent *e;
+    while (ret != 0 && (e = readdir(d))) {
+        /* Connectors are named cardN-CONNECTOR */
+        const char *conn = strchr(e->d_name, '-');
+        if (strncmp(e->d_name, "card", 4) || !conn) {
+            continue;
+        }
+        
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "/sys/class/drm/%s/%s", e->d_name, i2c);
+        bool found = access(path, F_OK) == 0;
+        if (!found) {
+            char link[PATH_MAX];
+            snprintf(path, sizeof(path), "/sys/class/drm/%s/ddc", e->d_name);
+            const ssize_t len = readlink(path, link, sizeof(link) - 1);
+            if (len > 0) {
+                link[len] = '\0';
+                const char *base = strrchr(link, '/');
+                found = !strcmp(base ? base + 1 : link, i2c);
+            }
+        }
+        if (found) {
+            snprintf(name, size, "%s", conn + 1);
+            ret = 0;
+        }
+    }
+    closedir(d);
+    return ret;
+}
+
+static void publish_ddc_backlight(const smooth_client *sc, const double curr_pct) {
+    ddc_bl_msg *msg = malloc(sizeof(ddc_bl_msg));
+    if (msg) {
+        snprintf(msg->output, sizeof(msg->output), "%s", sc->output);
+        msg->curr_pct = curr_pct;
+        msg->target_pct = sc->ddc_target;
+        m_publish(DDC_BL_TOPIC, msg, sizeof(ddc_bl_msg), true);
+    }
+}
+
+#endif
+
 static int set_single_serial(double target_pct, bool is_smooth, double smooth_step, 
                              const unsigned int smooth_wait, const char *serial, int verse) {
     int r = -1;
@@ -2,9 +2,28 @@
 
 #include "dpms.h"
 #include "polkit.h"
+#include <module/map.h>
+
+#define PENDING_TIMEOUT     1000    // ms to wait for plugin to notify completion, before signaling anyway
 
 static int method_getdpms(sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
 static int method_setdpms(sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
+static int watch_pending(dpms_plugin *plugin, int fd, const char *display, int level);
+static void emit_changed(dpms_plugin *plugin, const char *display, int level);
+
+/* A set whose completion is signaled asynchronously by plugin */
+typedef struct {
+    dpms_plugin *plugin;
+    char *display;
+    int level;
+    int fd;                     // plugin's completion fd
+    int timer_fd;               // fires if completion never gets notified
+} dpms_pending;
+
+static void finish_pending(dpms_pending *p);
+static void track_pending(dpms_pending *p, int fd, bool track);
+
+static map_t *pendings;     // unfinished sets, by both their fds
 
 static dpms_plugin *plugins[DPMS_NUM];
 static const char object_path[] = "/org/clightd/clightd/Dpms";
@@ -52,14 +71,40 @@ static void init(void) {
     if (r < 0) {
         m_log("Failed to issue method call: %s\n", strerror(-r));
     }
+    pendings = map_new(true, NULL);
 }
 
 static void receive(const msg_t *msg, const void *userdata) {
-
+    if (msg && !msg->is_pubsub) {
+        /*
+         * Both fds of a set may be ready at once: once finished by the first one,
+         * never touch it again for the other
+         */
+        char key[16];
+        snprintf(key, sizeof(key), "%d", msg->fd_msg->fd);
+        dpms_pending *p = map_get(pendings, key);
+        if (!p || p != msg->fd_msg->userptr) {
+            return;
+        }
+        
+        if (msg->fd_msg->fd == p->timer_fd) {
+            uint64_t t;
+            if (read(p->timer_fd, &t, sizeof(t)) != sizeof(t)) {
+                /* Not expired: stale event */
+                return;
+            }
+            m_log("Timed out waiting for dpms state %d.\n", p->level);
+            p->plugin->handle_pending(-1);
+            finish_pending(p);
+        } else if (p->plugin->handle_pending(msg->fd_msg->fd) <= 0) {
+            m_log("Dpms state %d reached.\n", p->level);
+            finish_pending(p);
+        }
+    }
 }
 
 static void destroy(void) {
-    
+    map_free(pendings);
 }
 
 void dpms_register_new(dpms_plugin *plugin) {
@@ -167,9 +212,69 @@ static int method_setdpms(sd_bus_message *m, void *userdata, sd_bus_error *ret_e
     }
     
     m_log("New dpms state: %d.\n", level);
+    /* Signal right away, unless plugin will tell us when the change is actually completed */
+    const int fd = plugin->pending_fd ? plugin->pending_fd() : -1;
+    if (fd < 0 || watch_pending(plugin, fd, display, level) != 0) {
+        emit_changed(plugin, display, level);
+    }
+    return sd_bus_reply_method_return(m, "b", true);
+}
+
+static int watch_pending(dpms_plugin *plugin, int fd, const char *display, int level) {
+    dpms_pending *p = calloc(1, sizeof(dpms_pending));
+    if (p) {
+        p->display = strdup(display);
+        p->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    }
+    if (!p || !p->display || p->timer_fd == -1 || m_register_fd(fd, true, p) != 0) {
+        if (p) {
+            if (p->timer_fd != -1) {
+                close(p->timer_fd);
+            }
+            free(p->display);
+            free(p);
+        }
+        close(fd);
+        plugin->handle_pending(-1);
+        return -1;
+    }
+    p->plugin = plugin;
+    p->level = level;
+    p->fd = fd;
+    
+    struct itimerspec timerValue = {{0}};
+    timerValue.it_value.tv_sec = PENDING_TIMEOUT / 1000;
+    timerValue.it_value.tv_nsec = 1000 * 1000 * (PENDING_TIMEOUT % 1000);
+    timerfd_settime(p->timer_fd, 0, &timerValue, NULL);
+    m_register_fd(p->timer_fd, true, p);
+    track_pending(p, p->fd, true);
+    track_pending(p, p->timer_fd, true);
+    return 0;
+}
+
+static void finish_pending(dpms_pending *p) {
+    emit_changed(p->plugin, p->display, p->level);
+    track_pending(p, p->fd, false);
+    track_pending(p, p->timer_fd, false);
+    m_deregister_fd(p->fd); // this will close fd
+    m_deregister_fd(p->timer_fd);
+    free(p->display);
+    free(p);
+}
+
+static void track_pending(dpms_pending *p, int fd, bool track) {
+    char key[16];
+    snprintf(key, sizeof(key), "%d", fd);
+    if (track) {
+        map_put(pendings, key, p);
+    } else {
+        map_remove(pendings, key);
+    }
+}
+
+static void emit_changed(dpms_plugin *plugin, const char *display, int level) {
     sd_bus_emit_signal(bus, object_path, bus_interface, "Changed", "si", display, level);
     sd_bus_emit_signal(bus, plugin->obj_path, bus_interface, "Changed", "si", display, level);
-    return sd_bus_reply_method_return(m, "b", true);
 }
 
 #endif
@@ -16,15 +16,20 @@ typedef struct {
     const char *name;
     int (*set)(const char *id, const char *env, int level);
     int (*get)(const char *id, const char *env);
+    /* Optional asynchronous set completion */
+    int (*pending_fd)(void);                // fd polled for last set completion (ownership is passed), or < 0 if already completed
+    int (*handle_pending)(int fd);          // consume completion events once fd is readable, or drop them if fd < 0 (timeout); returns number of still pending ones
     char obj_path[100];
 } dpms_plugin;
 
-#define DPMS(name) \
+#define DPMS_EXT(plugin_name, ...) \
     static int get(const char *id, const char *env); \
     static int set(const char *id, const char *env, int level); \
     static void _ctor_ register_gamma_plugin(void) { \
-        static dpms_plugin self = { name, set, get }; \
+        static dpms_plugin self = { .name = plugin_name, .set = set, .get = get, __VA_ARGS__ }; \
         dpms_register_new(&self); \
     }
 
+#define DPMS(name) DPMS_EXT(name)
+
 void dpms_register_new(dpms_plugin *plugin);
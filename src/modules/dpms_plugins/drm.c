@@ -1,10 +1,40 @@
 #include "dpms.h"
 #include "drm_utils.h"
- 
+#include "udev.h"
+#include <module/map.h>
+
+#define DRM_SUBSYSTEM "drm"
+
+/* Connectors of a card exposing DPMS, with its property id, and crtcs with their ACTIVE one */
+typedef struct {
+    int num_connectors;
+    uint32_t *connector_ids;
+    uint32_t *dpms_props;
+    int num_crtcs;              // 0 if driver is not atomic
+    uint32_t *crtc_ids;
+    uint32_t *active_props;
+} drm_dpms_topology;
+
+static drm_dpms_topology *get_topology(int fd, const char *card);
+static drm_dpms_topology *build_topology(int fd);
+static void build_crtcs(int fd, drm_dpms_topology *t, const drmModeRes *res);
+static void topology_dtor(void *data);
+static int set_atomic(int fd, const drm_dpms_topology *t, int level);
+static int pending_fd(void);
+static int handle_pending(int fd);
+static void commit_done(int fd, unsigned int sequence, unsigned int tv_sec, unsigned int tv_usec, void *user_data);
 static drmModeConnectorPtr get_active_connector(int fd, int connector_id);
-static drmModePropertyPtr drm_get_prop(int fd, drmModeConnectorPtr connector, const char *name);
+static int get_crtc_index(int fd, const drm_dpms_topology *t, drmModeConnectorPtr connector);
+static int get_crtc_active(int fd, const drm_dpms_topology *t, int idx);
+static uint32_t drm_get_prop(int fd, drmModeConnectorPtr connector, const char *name);
 
-DPMS("Drm");
+static map_t *topologies;           // cached topologies, by card
+static struct udev_monitor *mon;    // drm uevents (eg: hotplug) invalidate topologies
+static bool stale_topology;         // a cached connector could not be found anymore
+static int commit_fd = -1;          // fd of last nonblocking commit, until taken by dpms module
+static int pending_events;          // crtcs events still to be received for in-flight commit
+
+DPMS_EXT("Drm", .pending_fd = pending_fd, .handle_pending = handle_pending);
 
 /*
  * state will be one of:
@@ -18,31 +48,36 @@ DPMS("Drm");
  */
 static int get(const char *card, const char *env) {
     int state = -1;
-    drmModeConnectorPtr connector;
     
     int fd = drm_open_card(card);
     if (fd < 0) {
         return WRONG_PLUGIN;
     }
     
-    drmModeRes *res = drmModeGetResources(fd);
-    if (res) {
-        for (int i = 0; i < res->count_connectors; i++) {
-            connector = get_active_connector(fd, res->connectors[i]);
-            if (!connector) {
-                continue;
-            }
+    /* Atomic client cap is needed to see crtcs ACTIVE property */
+    const bool atomic = drmSetClientCap(fd, DRM_CLIENT_CAP_ATOMIC, 1) == 0;
+    drm_dpms_topology *t = get_topology(fd, card);
+    for (int i = 0; t && i < t->num_connectors && state == -1; i++) {
+        drmModeConnectorPtr connector = get_active_connector(fd, t->connector_ids[i]);
+        if (!connector) {
+            continue;
+        }
+        
+        /* On atomic drivers DPMS property is not updated when crtc is toggled through ACTIVE */
+        const int idx = atomic ? get_crtc_index(fd, t, connector) : -1;
+        const int active = idx != -1 ? get_crtc_active(fd, t, idx) : -1;
+        if (active != -1) {
+            state = active ? 0 : 3;
+        }
         
-            drmModePropertyPtr p = drm_get_prop(fd, connector, "DPMS");
-            if (p) {
-                /* prop_id is 2, it means it is second prop */
-                state = (int)connector->prop_values[p->prop_id - 1];
-                drmModeFreeProperty(p);
-                drmModeFreeConnector(connector);
+        /* Look value up by property id: props and prop_values are parallel arrays */
+        for (int j = 0; j < connector->count_props && state == -1; j++) {
+            if (connector->props[j] == t->dpms_props[i]) {
+                state = (int)connector->prop_values[j];
                 break;
             }
         }
-        drmModeFreeResources(res);
+        drmModeFreeConnector(connector);
     }
     close(fd);
     return state;
@@ -50,8 +85,6 @@ static int get(const char *card, const char *env) {
 
 static int set(const char *card, const char *env, int level) {
     int err = 0;
-    drmModeConnectorPtr connector;
-    drmModePropertyPtr prop;
     
     int fd = drm_open_card(card);
     if (fd < 0) {
@@ -64,27 +97,22 @@ static int set(const char *card, const char *env, int level) {
         goto end;
     }
     
-    drmModeRes *res = drmModeGetResources(fd);
-    if (res) {
-        for (int i = 0; i < res->count_connectors; i++) {
-            connector = get_active_connector(fd, res->connectors[i]);
+    /* Atomic client cap is needed to see and set crtcs ACTIVE property */
+    const bool atomic = drmSetClientCap(fd, DRM_CLIENT_CAP_ATOMIC, 1) == 0;
+    drm_dpms_topology *t = get_topology(fd, card);
+    /* Fallback to legacy per-connector DPMS property */
+    if (t && (!atomic || t->num_crtcs == 0 || set_atomic(fd, t, level) != 0)) {
+        for (int i = 0; i < t->num_connectors; i++) {
+            drmModeConnectorPtr connector = get_active_connector(fd, t->connector_ids[i]);
             if (!connector) {
                 continue;
             }
-            
-            prop = drm_get_prop(fd, connector, "DPMS");
-            if (!prop) {
-                drmModeFreeConnector(connector);
-                continue;
-            }
-            if (drmModeConnectorSetProperty(fd, connector->connector_id, prop->prop_id, level)) {
+            if (drmModeConnectorSetProperty(fd, connector->connector_id, t->dpms_props[i], level)) {
                 perror("drmModeConnectorSetProperty");
             }
-            drmModeFreeProperty(prop);
             drmModeFreeConnector(connector);
         }
-        drmModeFreeResources(res);
-    } else {
+    } else if (!t) {
         err = -errno;
     }
     
@@ -94,16 +122,222 @@ static int set(const char *card, const char *env, int level) {
     }
 
 end:
-    if (fd > 0) {
+    if (err && commit_fd == fd) {
+        /* Nobody will wait for its events */
+        commit_fd = -1;
+        pending_events = 0;
+    }
+    /* Nonblocking commit fd is kept open, to receive its completion events */
+    if (fd >= 0 && fd != commit_fd) {
         close(fd);
     }
     return err;
 }
 
+/*
+ * Connectors and their properties ids only change on hotplug or driver reload,
+ * both notified through drm uevents: avoid walking all of them on each call.
+ */
+static drm_dpms_topology *get_topology(int fd, const char *card) {
+    if (!topologies) {
+        topologies = map_new(true, topology_dtor);
+        if (init_udev_monitor(DRM_SUBSYSTEM, &mon) < 0) {
+            fprintf(stderr, "Failed to monitor drm uevents. Not caching connectors.\n");
+            udev_monitor_unref(mon);
+            mon = NULL;
+        }
+    }
+    
+    /* Monitor fd is nonblocking: just drain pending uevents */
+    struct udev_device *dev;
+    bool changed = stale_topology;
+    while (mon && (dev = udev_monitor_receive_device(mon))) {
+        udev_device_unref(dev);
+        changed = true;
+    }
+    /* Without monitor, we would never know when topology changes */
+    if (changed || !mon) {
+        map_clear(topologies);
+    }
+    stale_topology = false;
+    
+    const char *key = card ? card : "";
+    drm_dpms_topology *t = map_get(topologies, key);
+    if (!t) {
+        t = build_topology(fd);
+        if (t) {
+            map_put(topologies, key, t);
+        }
+    }
+    return t;
+}
+
+static drm_dpms_topology *build_topology(int fd) {
+    drmModeRes *res = drmModeGetResources(fd);
+    if (!res) {
+        return NULL;
+    }
+    
+    drm_dpms_topology *t = calloc(1, sizeof(drm_dpms_topology));
+    if (t) {
+        t->connector_ids = calloc(res->count_connectors, sizeof(uint32_t));
+        t->dpms_props = calloc(res->count_connectors, sizeof(uint32_t));
+        if ((!t->connector_ids || !t->dpms_props) && res->count_connectors > 0) {
+            topology_dtor(t);
+            t = NULL;
+        }
+    }
+    for (int i = 0; t && i < res->count_connectors; i++) {
+        /* Do not force a probe: connection state is checked on each call */
+        drmModeConnectorPtr connector = drmModeGetConnectorCurrent(fd, res->connectors[i]);
+        if (!connector) {
+            continue;
+        }
+        const uint32_t prop_id = drm_get_prop(fd, connector, "DPMS");
+        if (prop_id) {
+            t->connector_ids[t->num_connectors] = connector->connector_id;
+            t->dpms_props[t->num_connectors] = prop_id;
+            t->num_connectors++;
+        }
+        drmModeFreeConnector(connector);
+    }
+    if (t && drmSetClientCap(fd, DRM_CLIENT_CAP_ATOMIC, 1) == 0) {
+        build_crtcs(fd, t, res);
+    }
+    drmModeFreeResources(res);
+    return t;
+}
+
+static void build_crtcs(int fd, drm_dpms_topology *t, const drmModeRes *res) {
+    t->crtc_ids = calloc(res->count_crtcs, sizeof(uint32_t));
+    t->active_props = calloc(res->count_crtcs, sizeof(uint32_t));
+    if (!t->crtc_ids || !t->active_props) {
+        return;
+    }
+    for (int i = 0; i < res->count_crtcs; i++) {
+        drmModeObjectPropertiesPtr props = drmModeObjectGetProperties(fd, res->crtcs[i], DRM_MODE_OBJECT_CRTC);
+        if (!props) {
+            continue;
+        }
+        for (uint32_t j = 0; j < props->count_props; j++) {
+            drmModePropertyPtr prop = drmModeGetProperty(fd, props->props[j]);
+            if (prop) {
+                if (!strcmp(prop->name, "ACTIVE")) {
+                    t->crtc_ids[t->num_crtcs] = res->crtcs[i];
+                    t->active_props[t->num_crtcs] = prop->prop_id;
+                    t->num_crtcs++;
+                }
+                drmModeFreeProperty(prop);
+            }
+        }
+        drmModeFreeObjectProperties(props);
+    }
+}
+
+static void topology_dtor(void *data) {
+    drm_dpms_topology *t = (drm_dpms_topology *)data;
+    free(t->connector_ids);
+    free(t->dpms_props);
+    free(t->crtc_ids);
+    free(t->active_props);
+    free(t);
+}
+
+static void _dtor_ destroy_topologies(void) {
+    if (topologies) {
+        map_free(topologies);
+        udev_monitor_unref(mon);
+    }
+}
+
+/*
+ * Toggle ACTIVE of all crtcs driving connected outputs in a single commit,
+ * so that multiple monitors blank at once instead of one after the other.
+ * When no other commit is in flight, it is nonblocking: completion
+ * is then notified through one event for each toggled crtc.
+ */
+static int set_atomic(int fd, const drm_dpms_topology *t, int level) {
+    drmModeAtomicReq *req = drmModeAtomicAlloc();
+    bool *queued = calloc(t->num_crtcs, sizeof(bool));
+    if (!req || !queued) {
+        drmModeAtomicFree(req);
+        free(queued);
+        return -ENOMEM;
+    }
+    
+    /* Crtcs are either on or off: standby and suspend just turn them off */
+    const int active = level == 0;
+    int ret = 0, num_crtcs = 0;
+    for (int i = 0; i < t->num_connectors && !ret; i++) {
+        drmModeConnectorPtr connector = get_active_connector(fd, t->connector_ids[i]);
+        if (!connector) {
+            continue;
+        }
+        const int idx = get_crtc_index(fd, t, connector);
+        drmModeFreeConnector(connector);
+        /* Cloned outputs share the crtc */
+        if (idx == -1 || queued[idx]) {
+            continue;
+        }
+        queued[idx] = true;
+        
+        /* Requesting an event for a crtc that is and stays off is an error */
+        if (get_crtc_active(fd, t, idx) == active) {
+            continue;
+        }
+        if (drmModeAtomicAddProperty(req, t->crtc_ids[idx], t->active_props[idx], active) < 0) {
+            ret = -ENOMEM;
+        } else {
+            num_crtcs++;
+        }
+    }
+    
+    if (!ret && num_crtcs > 0) {
+        bool committed = false;
+        if (pending_events == 0 &&
+            drmModeAtomicCommit(fd, req, DRM_MODE_ATOMIC_ALLOW_MODESET | DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT, NULL) == 0) {
+            commit_fd = fd;
+            pending_events = num_crtcs;
+            committed = true;
+        }
+        if (!committed) {
+            /* Previous commit still in flight, or nonblocking one failed: just wait for this one to be done */
+            ret = drmModeAtomicCommit(fd, req, DRM_MODE_ATOMIC_ALLOW_MODESET, NULL);
+        }
+    }
+    free(queued);
+    drmModeAtomicFree(req);
+    return ret;
+}
+
+static int pending_fd(void) {
+    const int fd = commit_fd;
+    commit_fd = -1;
+    return fd;
+}
+
+static int handle_pending(int fd) {
+    drmEventContext ctx = { .version = 2, .page_flip_handler = commit_done };
+    if (fd < 0 || drmHandleEvent(fd, &ctx) != 0) {
+        /* Do not wait forever for events we won't be able to read */
+        pending_events = 0;
+    }
+    return pending_events;
+}
+
+static void commit_done(int fd, unsigned int sequence, unsigned int tv_sec, unsigned int tv_usec, void *user_data) {
+    if (pending_events > 0) {
+        pending_events--;
+    }
+}
+
 static drmModeConnectorPtr get_active_connector(int fd, int connector_id) {
-    drmModeConnectorPtr connector = drmModeGetConnector(fd, connector_id);
+    drmModeConnectorPtr connector = drmModeGetConnectorCurrent(fd, connector_id);
     
-    if (connector) {
+    if (!connector) {
+        /* Eg: MST connector gone without us receiving its uevent: rebuild topology on next call */
+        stale_topology = true;
+    } else {
         if (connector->connection == DRM_MODE_CONNECTED 
             && connector->count_modes > 0 && connector->encoder_id != 0) {
             return connector;
@@ -113,7 +347,36 @@ static drmModeConnectorPtr get_active_connector(int fd, int connector_id) {
     return NULL;
 }
 
-static drmModePropertyPtr drm_get_prop(int fd, drmModeConnectorPtr connector, const char *name) {
+static int get_crtc_index(int fd, const drm_dpms_topology *t, drmModeConnectorPtr connector) {
+    int idx = -1;
+    drmModeEncoderPtr encoder = drmModeGetEncoder(fd, connector->encoder_id);
+    if (encoder) {
+        for (int i = 0; i < t->num_crtcs && idx == -1; i++) {
+            if (t->crtc_ids[i] == encoder->crtc_id) {
+                idx = i;
+            }
+        }
+        drmModeFreeEncoder(encoder);
+    }
+    return idx;
+}
+
+/* Returns crtc ACTIVE property value, or -1 */
+static int get_crtc_active(int fd, const drm_dpms_topology *t, int idx) {
+    int active = -1;
+    drmModeObjectPropertiesPtr props = drmModeObjectGetProperties(fd, t->crtc_ids[idx], DRM_MODE_OBJECT_CRTC);
+    if (props) {
+        for (uint32_t j = 0; j < props->count_props && active == -1; j++) {
+            if (props->props[j] == t->active_props[idx]) {
+                active = props->prop_values[j] != 0;
+            }
+        }
+        drmModeFreeObjectProperties(props);
+    }
+    return active;
+}
+
+static uint32_t drm_get_prop(int fd, drmModeConnectorPtr connector, const char *name) {
     drmModePropertyPtr props;
     
     for (int i = 0; i < connector->count_props; i++) {
@@ -121,10 +384,11 @@ static drmModePropertyPtr drm_get_prop(int fd, drmModeConnectorPtr connector, co
         if (!props) {
             continue;
         }
-        if (!strcmp(props->name, name)) {
-            return props;
-        }
+        const uint32_t prop_id = !strcmp(props->name, name) ? props->prop_id : 0;
         drmModeFreeProperty(props);
+        if (prop_id) {
+            return prop_id;
+        }
     }
-    return NULL;
+    return 0;
 }
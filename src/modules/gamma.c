@@ -11,16 +11,54 @@
 #include <math.h>
 #include "gamma.h"
 
-static unsigned short get_red(int temp);
-static unsigned short get_green(int temp);
-static unsigned short get_blue(int temp);
+#define TEMP_MIN    1000
+#define TEMP_MAX    10000
+#define RAMP_CACHE_SIZE 8       // ramps kept around, eg: for multiple outputs with different ramp sizes
+#define SCALE_ONE       1000    // ramps brightness scale is stored in permille
+#define DIM_MIN_SCALE   0.2     // never dim an output below this, while its DDC backlight catches up
+#define IDLE_TIMEOUT    30      // seconds a client is kept around after its last Set/Get
+#define MAX_RETRIES     5       // failed steps before giving up a transition
+#define RETRY_WAIT      100     // ms, multiplied by number of failures
+
+/* Ready-made r,g,b ramps (contiguous) for a given ramp size and temperature */
+typedef struct {
+    uint32_t ramp_size;
+    int temp;
+    int scale;
+    uint64_t last_used;
+    uint16_t *ramp;
+} ramp_entry;
+
+static unsigned short compute_red(int temp);
+static unsigned short compute_green(int temp);
+static unsigned short compute_blue(int temp);
+static void init_temp_lut(void);
+static void fill_inverse_index(uint16_t index[UINT8_MAX + 1], const int chan, const int fixed_chan);
+static void build_ramp(uint16_t *r, uint16_t *g, uint16_t *b, uint32_t ramp_size, int temp, int scale);
+static void handle_ddc_backlight(const ddc_bl_msg *msg);
+static map_ret_code apply_scale(void *userptr, const char *key, void *data);
 static void client_dtor(void *c);
 static int method_setgamma(sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
 static int method_getgamma(sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
+static char *client_key(const char *display, const char *env);
+static gamma_client *get_client(const char *display, const char *env);
 static gamma_client *fetch_client(gamma_plugin *plugin, const char *display, const char *xauth, int *err);
 static int start_client(gamma_client *sc, int temp, bool is_smooth, unsigned int smooth_step, unsigned int smooth_wait);
+static void schedule_step(gamma_client *cl, unsigned int wait_ms);
+static void arm_idle(gamma_client *cl);
+static void end_transition(gamma_client *cl);
 
 static map_t *clients;
+/* Per-channel factors (0-255) for each temperature, and their inverse indexes */
+static uint8_t temp_lut[TEMP_MAX - TEMP_MIN + 1][3];
+static uint16_t temp_by_blue[UINT8_MAX + 1];    // temperatures with red == 255, ie: <= 6500K
+static uint16_t temp_by_red[UINT8_MAX + 1];     // temperatures with blue == 255, ie: >= 6500K
+static ramp_entry ramp_cache[RAMP_CACHE_SIZE];
+static uint64_t ramp_clock;
+static map_t *output_scales;        // temporary brightness scale of outputs, set while their DDC backlight catches up
+static gamma_plugin *last_plugin;   // last display whose temperature was set, reopened to apply output scales once its client is gone
+static char *last_display, *last_env;
+static int last_temp;
 static gamma_plugin *plugins[GAMMA_NUM];
 static const char object_path[] = "/org/clightd/clightd/Gamma";
 static const char bus_interface[] = "org.clightd.clightd.Gamma";
@@ -43,6 +81,8 @@ static bool evaluate(void) {
 }
 
 static void init(void) {
+    init_temp_lut();
+    
     int r = sd_bus_add_object_vtable(bus,
                                      NULL,
                                      object_path,
@@ -66,14 +106,26 @@ static void init(void) {
     } else {
         clients = map_new(false, client_dtor);
     }
+    output_scales = map_new(true, free);
+    m_subscribe(DDC_BL_TOPIC);
 }
 
 static void receive(const msg_t *msg, const void *userdata) {
     if (msg && !msg->is_pubsub) {
-        uint64_t t;
-        // nonblocking mode!
-        read(msg->fd_msg->fd, &t, sizeof(uint64_t));
         gamma_client *sc = (gamma_client *)msg->fd_msg->userptr;
+        if (msg->fd_msg->fd == sc->idle_fd) {
+            m_log("Releasing idle client for %s.\n", sc->display);
+            map_remove(clients, sc->key); // this will free sc->key
+            return;
+        }
+        
+        if (sc->vblank) {
+            sc->plugin->handle_vblank(sc->priv);
+        } else {
+            uint64_t t;
+            // nonblocking mode!
+            read(msg->fd_msg->fd, &t, sizeof(uint64_t));
+        }
             
         if (sc->is_smooth) {
             if (sc->target_temp < sc->current_temp) {
@@ -93,21 +145,112 @@ static void receive(const msg_t *msg, const void *userdata) {
         sd_bus_emit_signal(bus, object_path, bus_interface, "Changed", "si", sc->display, sc->current_temp);
         sd_bus_emit_signal(bus, sc->plugin->obj_path, bus_interface, "Changed", "si", sc->display, sc->current_temp);
         
-        if (sc->plugin->set(sc->priv, sc->current_temp) == 0 && sc->current_temp == sc->target_temp) {
+        const int ret = sc->plugin->set(sc->priv, sc->current_temp);
+        if (ret == 0) {
+            sc->retries = 0;
+            if (last_display && !strcmp(sc->display, last_display) && !strcmp(sc->env, last_env)) {
+                last_temp = sc->current_temp;
+            }
+        }
+        if (ret == 0 && sc->current_temp == sc->target_temp) {
             m_log("Reached target temp: %d.\n", sc->target_temp);
-            m_deregister_fd(sc->fd); // this will close fd
-            map_remove(clients, sc->display); // this will free sc->display (used as key)
+            /* Keep client (and its display connection) around for next Set/Get calls */
+            end_transition(sc);
+        } else if (ret == 0) {
+            schedule_step(sc, sc->smooth_wait);
+        } else if (++sc->retries <= MAX_RETRIES) {
+            /* Back off, even when not smooth, instead of spinning on a failing display */
+            schedule_step(sc, sc->smooth_wait + sc->retries * RETRY_WAIT);
         } else {
-            struct itimerspec timerValue = {{0}};
-            timerValue.it_value.tv_sec = sc->smooth_wait / 1000; // in ms
-            timerValue.it_value.tv_nsec = 1000 * 1000 * (sc->smooth_wait % 1000); // ms
-            timerfd_settime(sc->fd, 0, &timerValue, NULL);
+            m_log("Failed to set gamma on %s. Giving up.\n", sc->display);
+            /* Stop stepping: client will now be evicted once idle */
+            sc->retries = 0;
+            sc->target_temp = sc->current_temp;
+            end_transition(sc);
+        }
+    } else if (msg && msg->ps_msg->type == USER && !strcmp(msg->ps_msg->topic, DDC_BL_TOPIC)) {
+        handle_ddc_backlight((const ddc_bl_msg *)msg->ps_msg->message);
+    }
+}
+
+/*
+ * An external monitor backlight is changing through (slow) DDC writes:
+ * immediately dim its output through gamma ramps by the missing ratio,
+ * relaxing back to 1.0 as the monitor catches up.
+ */
+static void handle_ddc_backlight(const ddc_bl_msg *msg) {
+    double scale = 1.0;
+    if (msg->target_pct < msg->curr_pct) {
+        scale = clamp(msg->target_pct / msg->curr_pct, DIM_MIN_SCALE, 1.0);
+    }
+    
+    double *old = map_get(output_scales, msg->output);
+    if (scale == 1.0) {
+        if (!old) {
+            return;
         }
+        map_remove(output_scales, msg->output);
+    } else if (old) {
+        if (*old == scale) {
+            return;
+        }
+        *old = scale;
+    } else {
+        double *s = malloc(sizeof(double));
+        if (!s) {
+            return;
+        }
+        *s = scale;
+        map_put(output_scales, msg->output, s);
+    }
+    
+    /* Apply right away to every running or kept client, without changing their temperature */
+    int applied = 0;
+    map_iterate(clients, apply_scale, &applied);
+    if (applied > 0) {
+        return;
+    }
+    
+    if (!last_display || last_temp < TEMP_MIN || last_temp > TEMP_MAX) {
+        m_log("Not dimming %s through gamma: temperature was never set, no display known.\n", msg->output);
+        return;
+    }
+    
+    /* All clients went idle: reopen last display whose temperature was set */
+    int error = 0;
+    gamma_client *cl = fetch_client(last_plugin, last_display, last_env, &error);
+    if (cl) {
+        start_client(cl, last_temp, false, 0, 0);
+    } else {
+        m_log("Failed to apply gamma scale to %s: %d.\n", msg->output, error);
+    }
+}
+
+static map_ret_code apply_scale(void *userptr, const char *key, void *data) {
+    gamma_client *cl = (gamma_client *)data;
+    int *applied = (int *)userptr;
+    if ((int)cl->current_temp < TEMP_MIN || (cl->plugin->is_alive && !cl->plugin->is_alive(cl->priv))) {
+        /* Dead clients are dropped on next Set/Get */
+        return MAP_OK;
+    }
+    if (cl->current_temp != cl->target_temp) {
+        /* Next step will apply it */
+        (*applied)++;
+    } else if (cl->plugin->set(cl->priv, cl->current_temp) == 0) {
+        (*applied)++;
+        end_transition(cl);
     }
+    return MAP_OK;
 }
 
 static void destroy(void) {
     map_free(clients);
+    map_free(output_scales);
+    free(last_display);
+    free(last_env);
+    for (int i = 0; i < RAMP_CACHE_SIZE; i++) {
+        free(ramp_cache[i].ramp);
+    }
 }
 
 /** Exposed API in gamma.h **/
@@ -143,7 +286,7 @@ double clamp(double x, double min, double max) {
     return x;
 }
 
-static unsigned short get_red(int temp) {
+static unsigned short compute_red(int temp) {
     if (temp <= 6500) {
         return 255;
     }
@@ -155,7 +298,7 @@ static unsigned short get_red(int temp) {
     return clamp(a + b * new_temp + c * log(new_temp), 0, 255);
 }
 
-static unsigned short get_green(int temp) {
+static unsigned short compute_green(int temp) {
     double a, b, c;
     double new_temp;
     if (temp <= 6500) {
@@ -172,7 +315,7 @@ static unsigned short get_green(int temp) {
     return clamp(a + b * new_temp + c * log(new_temp), 0, 255);
 }
 
-static unsigned short get_blue(int temp) {
+static unsigned short compute_blue(int temp) {
     if (temp <= 1900) {
         return 0;
     }
@@ -188,67 +331,179 @@ static unsigned short get_blue(int temp) {
     return 255;
 }
 
-/* Thanks to: https://github.com/neilbartlett/color-temperature/blob/master/index.js */
-int get_temp(const unsigned short R, const unsigned short B) {
-    int temperature;
-    int min_temp = B == 255 ? 6500 : 1000; // lower bound
-    int max_temp = R == 255 ? 6500 : 10000; // upper bound
-    unsigned short testR, testB;
-    
-    int ctr = 0;
-    
-    /* Compute first temperature with same R and B value as parameters */
-    do {
-        temperature = (max_temp + min_temp) / 2;
-        testR = get_red(temperature);
-        testB = get_blue(temperature);
-        if ((double) testB / testR > (double) B / R) {
-            max_temp = temperature;
-        } else {
-            min_temp = temperature;
+/* Evaluate curves once for each temperature (1K resolution), then build inverse indexes */
+static void init_temp_lut(void) {
+    for (int t = TEMP_MIN; t <= TEMP_MAX; t++) {
+        temp_lut[t - TEMP_MIN][0] = compute_red(t);
+        temp_lut[t - TEMP_MIN][1] = compute_green(t);
+        temp_lut[t - TEMP_MIN][2] = compute_blue(t);
+    }
+    fill_inverse_index(temp_by_blue, 2, 0);
+    fill_inverse_index(temp_by_red, 0, 2);
+}
+
+/* 3 for multiples of 1000K, 2 for 500K, 1 for 100K, 0 for 50K, -1 otherwise */
+static int roundness(const int t) {
+    const int steps[] = { 1000, 500, 100, 50 };
+    for (int i = 0; i < 4; i++) {
+        if (t % steps[i] == 0) {
+            return 3 - i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Map each value of chan (while fixed_chan is 255) to the "roundest" temperature giving it,
+ * eg: 6500 instead of 6537, or middle of the range if none is a multiple of 50K.
+ * Values never reached by the curve get the nearest reached one's temperature.
+ */
+static void fill_inverse_index(uint16_t index[UINT8_MAX + 1], const int chan, const int fixed_chan) {
+    int lo[UINT8_MAX + 1], hi[UINT8_MAX + 1], best[UINT8_MAX + 1];
+    for (int v = 0; v <= UINT8_MAX; v++) {
+        lo[v] = hi[v] = best[v] = -1;
+    }
+    for (int t = TEMP_MIN; t <= TEMP_MAX; t++) {
+        if (temp_lut[t - TEMP_MIN][fixed_chan] != UINT8_MAX) {
+            continue;
+        }
+        const int v = temp_lut[t - TEMP_MIN][chan];
+        if (lo[v] == -1) {
+            lo[v] = t;
+        }
+        hi[v] = t;
+        if (best[v] == -1 || roundness(t) > roundness(best[v])) {
+            best[v] = t;
         }
-        ctr++;
-    } while ((testR != R || testB != B) && (ctr < 10));
+    }
     
-    /* try to fit value in 50-steps temp -> ie: instead of 5238, try 5200 or 5250 */
-    if (temperature % 50 != 0) {
-        int tmp_temp = temperature - temperature % 50;
-        if (get_red(tmp_temp) == R && get_blue(tmp_temp) == B) {
-            temperature = tmp_temp;
+    for (int v = 0; v <= UINT8_MAX; v++) {
+        if (best[v] != -1) {
+            index[v] = roundness(best[v]) >= 0 ? best[v] : (lo[v] + hi[v]) / 2;
         } else {
-            tmp_temp = temperature + 50 - temperature % 50;
-            if (get_red(tmp_temp) == R && get_blue(tmp_temp) == B) {
-                temperature = tmp_temp;
-            }
+            index[v] = 0;
+        }
+    }
+    /* Fill holes with nearest valid value */
+    for (int v = 1; v <= UINT8_MAX; v++) {
+        if (!index[v]) {
+            index[v] = index[v - 1];
+        }
+    }
+    for (int v = UINT8_MAX - 1; v >= 0; v--) {
+        if (!index[v]) {
+            index[v] = index[v + 1];
         }
     }
-    
-    return temperature;
 }
 
-void fill_gamma_table(uint16_t *r, uint16_t *g, uint16_t *b, uint32_t ramp_size, int temp) {
-    const double red = get_red(temp) / (double)UINT8_MAX;
-    const double green = get_green(temp) / (double)UINT8_MAX;
-    const double blue = get_blue(temp) / (double)UINT8_MAX;
+/* Returns r, g and b factors (0-255) for temp */
+const uint8_t *get_temp_factors(int temp) {
+    return temp_lut[(int)clamp(temp, TEMP_MIN, TEMP_MAX) - TEMP_MIN];
+}
+
+/*
+ * O(1) lookup: one among R and B is always 255 on the curve.
+ * When neither is (eg: ramps scaled by someone else), normalize brightest one to 255.
+ */
+int get_temp(const unsigned short R, const unsigned short B) {
+    if (R >= B) {
+        const int b = R ? clamp(B * UINT8_MAX / R, 0, UINT8_MAX) : UINT8_MAX;
+        return temp_by_blue[b];
+    }
+    return temp_by_red[(int)clamp(R * UINT8_MAX / B, 0, UINT8_MAX)];
+}
+
+/* Integer only, branchless loops: let the compiler vectorize them */
+static void build_ramp(uint16_t *r, uint16_t *g, uint16_t *b, uint32_t ramp_size, int temp, int scale) {
+    const uint8_t *f = get_temp_factors(temp);
+    uint16_t *chans[3] = { r, g, b };
+    for (int c = 0; c < 3; c++) {
+        uint16_t *out = chans[c];
+        const uint32_t factor = f[c] * scale / SCALE_ONE;
+        for (uint32_t i = 0; i < ramp_size; ++i) {
+            const uint32_t val = UINT16_MAX * i / ramp_size;
+            out[i] = val * factor / UINT8_MAX;
+        }
+    }
+}
+
+/*
+ * Returns r, g and b ramps, each ramp_size long and contiguous,
+ * with brightness scaled by scale (0-1, see gamma_output_scale()).
+ * Ramps are kept in a small LRU cache, so that multiple outputs
+ * sharing ramp size get it built only once for each temperature.
+ * Returned pointer is valid until next call.
+ */
+const uint16_t *get_gamma_ramp(uint32_t ramp_size, int temp, double scale) {
+    const int sc = clamp(scale, 0.0, 1.0) * SCALE_ONE;
+    ramp_entry *e = &ramp_cache[0];
+    for (int i = 0; i < RAMP_CACHE_SIZE; i++) {
+        if (ramp_cache[i].ramp && ramp_cache[i].ramp_size == ramp_size && 
+            ramp_cache[i].temp == temp && ramp_cache[i].scale == sc) {
+            ramp_cache[i].last_used = ++ramp_clock;
+            return ramp_cache[i].ramp;
+        }
+        if (ramp_cache[i].last_used < e->last_used) {
+            e = &ramp_cache[i];
+        }
+    }
     
-    for (uint32_t i = 0; i < ramp_size; ++i) {
-        const double val = UINT16_MAX * i / ramp_size;
-        r[i] = val * red;
-        g[i] = val * green;
-        b[i] = val * blue;
+    /* Miss: reuse least recently used entry, reallocating only when ramp size changes */
+    if (!e->ramp || e->ramp_size != ramp_size) {
+        uint16_t *ramp = realloc(e->ramp, 3 * ramp_size * sizeof(uint16_t));
+        if (!ramp) {
+            return NULL;
+        }
+        e->ramp = ramp;
+        e->ramp_size = ramp_size;
     }
+    e->temp = temp;
+    e->scale = sc;
+    e->last_used = ++ramp_clock;
+    build_ramp(e->ramp, e->ramp + ramp_size, e->ramp + 2 * ramp_size, ramp_size, temp, sc);
+    return e->ramp;
+}
+
+void fill_scaled_gamma_table(uint16_t *r, uint16_t *g, uint16_t *b, uint32_t ramp_size, int temp, double scale) {
+    const uint16_t *ramp = get_gamma_ramp(ramp_size, temp, scale);
+    if (ramp) {
+        memcpy(r, ramp, ramp_size * sizeof(uint16_t));
+        memcpy(g, ramp + ramp_size, ramp_size * sizeof(uint16_t));
+        memcpy(b, ramp + 2 * ramp_size, ramp_size * sizeof(uint16_t));
+    } else {
+        build_ramp(r, g, b, ramp_size, temp, clamp(scale, 0.0, 1.0) * SCALE_ONE);
+    }
+}
+
+void fill_gamma_table(uint16_t *r, uint16_t *g, uint16_t *b, uint32_t ramp_size, int temp) {
+    fill_scaled_gamma_table(r, g, b, ramp_size, temp, 1.0);
+}
+
+/* Temporary brightness scale for a given output (eg: DP-1), 1.0 when not dimmed */
+double gamma_output_scale(const char *output) {
+    const double *scale = output ? map_get(output_scales, output) : NULL;
+    return scale ? *scale : 1.0;
 }
 /** **/
 
 static void client_dtor(void *c) {
     gamma_client *cl = (gamma_client *)c;
     
+    /* Timerfds are closed by libmodule; vblank fd by plugin's dtor */
+    if (cl->fd != -1) {
+        m_deregister_fd(cl->fd);
+    }
+    if (cl->idle_fd != -1) {
+        m_deregister_fd(cl->idle_fd);
+    }
     if (cl->plugin) {
         cl->plugin->dtor(cl->priv);
     }
     free(cl->priv);
     free(cl->display);
     free(cl->env);
+    free(cl->key);
     free(cl);
 }
 
@@ -270,13 +525,24 @@ static int method_setgamma(sd_bus_message *m, void *userdata, sd_bus_error *ret_
     if (temp < 1000 || temp > 10000) {
         error = EINVAL;
     } else {
-        gamma_client *sc = map_get(clients, display);
+        gamma_client *sc = get_client(display, env);
         if (!sc) {
             sc = fetch_client(userdata, display, env, &error);
         }
         if (sc) {
             error = start_client(sc, temp, is_smooth, smooth_step, smooth_wait);
         }
+        if (!error) {
+            /* Remember it, to apply output scales without a temperature change once its client is gone */
+            if (!last_display || strcmp(last_display, display) || strcmp(last_env, env)) {
+                free(last_display);
+                free(last_env);
+                last_display = strdup(display);
+                last_env = strdup(env);
+                last_temp = sc->current_temp;
+            }
+            last_plugin = sc->plugin;
+        }
     }
     
     if (error) {
@@ -312,15 +578,15 @@ static int method_getgamma(sd_bus_message *m, void *userdata, sd_bus_error *ret_
         return r;
     }
     
-    gamma_client *cl = map_get(clients, display);
+    /* Running clients know their current temperature: no need to ask the display */
+    gamma_client *cl = get_client(display, env);
     if (cl) {
         temp = cl->current_temp;
-    } else {
-        cl = fetch_client(userdata, display, env, &error);
-        if (cl) {
-            temp = cl->current_temp;
-            client_dtor(cl);
-        }
+        arm_idle(cl);
+    } else if ((cl = fetch_client(userdata, display, env, &error))) {
+        /* Unprivileged call: never keep its display connection around */
+        temp = cl->current_temp;
+        client_dtor(cl);
     }
     
     if (error || temp == -1) {
@@ -342,12 +608,47 @@ static int method_getgamma(sd_bus_message *m, void *userdata, sd_bus_error *ret_
     return sd_bus_reply_method_return(m, "i", temp);
 }
 
+/* Display name may contain any char: prefix it with its length to keep keys unique */
+static char *client_key(const char *display, const char *env) {
+    char *key = NULL;
+    if (asprintf(&key, "%zu:%s%s", strlen(display), display, env) == -1) {
+        return NULL;
+    }
+    return key;
+}
+
+/*
+ * Running client for display, opened with same env,
+ * dropping it if its display connection went away in the meantime.
+ */
+static gamma_client *get_client(const char *display, const char *env) {
+    char *key = client_key(display, env);
+    if (!key) {
+        return NULL;
+    }
+    gamma_client *cl = map_get(clients, key);
+    if (cl && cl->plugin->is_alive && !cl->plugin->is_alive(cl->priv)) {
+        m_log("Dropping client for %s: display went away.\n", display);
+        map_remove(clients, key);
+        cl = NULL;
+    }
+    free(key);
+    return cl;
+}
+
 static gamma_client *fetch_client(gamma_plugin *plugin, const char *display, const char *env, int *err) {
     gamma_client *cl = calloc(1, sizeof(gamma_client));
     if (cl) {
         cl->fd = -1;
+        cl->idle_fd = -1;
         cl->display = strdup(display);
         cl->env = strdup(env);
+        cl->key = client_key(display, env);
+        if (!cl->display || !cl->env || !cl->key) {
+            *err = ENOMEM;
+            client_dtor(cl);
+            return NULL;
+        }
         if (!plugin) {
             *err = WRONG_PLUGIN;
             for (int i = 0; i < GAMMA_NUM && *err == WRONG_PLUGIN; i++) {
@@ -363,6 +664,17 @@ static gamma_client *fetch_client(gamma_plugin *plugin, const char *display, con
         } else {
             cl->plugin = plugin;
             cl->current_temp = cl->plugin->get(cl->priv);
+            cl->target_temp = cl->current_temp;
+            cl->keep_alive = (int)cl->current_temp == -1;
+            cl->idle_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+            if (cl->idle_fd == -1) {
+                perror("timerfd_create");
+                *err = errno;
+                client_dtor(cl);
+                cl = NULL;
+            } else {
+                m_register_fd(cl->idle_fd, true, cl);
+            }
         }
     }
     return cl;
@@ -373,24 +685,76 @@ static int start_client(gamma_client *cl, int temp, bool is_smooth, unsigned int
     cl->is_smooth = is_smooth && smooth_step && smooth_wait;
     cl->smooth_step = smooth_step;
     cl->smooth_wait = smooth_wait;
-    
-    // NOTE: it seems like on wayland smooth transitions are not working.
-    // Forcefully disable them for now.
-    if (cl->is_smooth && cl->plugin == plugins[WL]) {
-        fprintf(stderr, "Smooth transitions are not supported on wayland.\n");
+    cl->retries = 0;
+    /* Nothing to fade from when current temperature is unknown */
+    if ((int)cl->current_temp < TEMP_MIN) {
         cl->is_smooth = false;
     }
     
+    /* Never evict a client while transitioning */
+    arm_idle(cl);
+    
     if (cl->fd == -1) {
+        /* Prefer pacing steps on plugin's vblank events, if available */
+        if (cl->plugin->vblank_fd && (cl->fd = cl->plugin->vblank_fd(cl->priv)) >= 0) {
+            cl->vblank = true;
+            m_register_fd(cl->fd, false, cl);
+        } else {
+            cl->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+            m_register_fd(cl->fd, true, cl);
+        }
+    }
+    
+    // start transitioning right now (ie: on next vblank)
+    schedule_step(cl, 0);
+    if (map_get(clients, cl->key) == cl) {
+        return 0;
+    }
+    return map_put(clients, cl->key, cl);
+}
+
+static void schedule_step(gamma_client *cl, unsigned int wait_ms) {
+    if (cl->vblank) {
+        if (cl->plugin->schedule(cl->priv, wait_ms) == 0) {
+            return;
+        }
+        /* Vblank events not available (eg: crtc got disabled): fallback to timerfd */
+        m_log("Failed to schedule vblank event. Falling back to timer.\n");
+        m_deregister_fd(cl->fd);
+        cl->vblank = false;
         cl->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
         m_register_fd(cl->fd, true, cl);
     }
-            
-    // start transitioning right now
+    
     struct itimerspec timerValue = {{0}};
-    timerValue.it_value.tv_nsec = 1;
+    if (wait_ms) {
+        timerValue.it_value.tv_sec = wait_ms / 1000; // in ms
+        timerValue.it_value.tv_nsec = 1000 * 1000 * (wait_ms % 1000); // ms
+    } else {
+        timerValue.it_value.tv_nsec = 1;
+    }
     timerfd_settime(cl->fd, 0, &timerValue, NULL);
-    return map_put(clients, cl->display, cl);
+}
+
+/*
+ * (Re)start idle eviction timer of clients that reached their target.
+ * Clients whose gamma would be reset by their release are kept until destroy,
+ * unless their display connection is already gone.
+ */
+static void arm_idle(gamma_client *cl) {
+    struct itimerspec timerValue = {{0}};
+    const bool alive = !cl->plugin->is_alive || cl->plugin->is_alive(cl->priv);
+    if ((!cl->keep_alive || !alive) && cl->current_temp == cl->target_temp) {
+        timerValue.it_value.tv_sec = IDLE_TIMEOUT;
+    }
+    timerfd_settime(cl->idle_fd, 0, &timerValue, NULL);
+}
+
+static void end_transition(gamma_client *cl) {
+    if (cl->plugin->end_transition) {
+        cl->plugin->end_transition(cl->priv);
+    }
+    arm_idle(cl);
 }
 
 #endif
@@ -26,7 +26,12 @@ typedef struct _gamma_cl {
     unsigned int current_temp;
     char *display;
     char *env;
+    char *key;                  // clients map key, built from both display and env
     int fd;
+    bool vblank;                // whether fd is plugin's vblank events one, instead of a timerfd
+    int idle_fd;                // timerfd evicting the client once idle
+    bool keep_alive;            // gamma cannot be read back, and is reset once client goes away (eg: wlr gamma control)
+    unsigned int retries;       // consecutive failed steps
     struct _gamma_plugin *plugin;
     void *priv;
 } gamma_client;
@@ -37,20 +42,35 @@ typedef struct _gamma_plugin {
     int (*set)(void *priv_data, const int temp);
     int (*get)(void *priv_data);
     int (*dtor)(void *priv_data);
+    /* Optional vblank paced stepping */
+    int (*vblank_fd)(void *priv_data);                          // fd polled for vblank events, or < 0 if unavailable
+    int (*schedule)(void *priv_data, unsigned int wait_ms);     // request a vblank event at least wait_ms from now
+    void (*handle_vblank)(void *priv_data);                     // consume vblank events once fd is readable
+    /* Optional: whether display connection of a kept around client is still usable */
+    bool (*is_alive)(void *priv_data);
+    /* Optional: called once a transition is over, to release what is only needed while stepping */
+    void (*end_transition)(void *priv_data);
     char obj_path[100];
 } gamma_plugin;
 
-#define GAMMA(name) \
+#define GAMMA_EXT(plugin_name, ...) \
     static int validate(const char *id, const char *env, void **priv_data); \
     static int set(void *priv_data, const int temp); \
     static int get(void *priv_data); \
     static int dtor(void *priv_data); \
     static void _ctor_ register_gamma_plugin(void) { \
-        static gamma_plugin self = { name, validate, set, get, dtor }; \
+        static gamma_plugin self = { .name = plugin_name, .validate = validate, .set = set, \
+                                     .get = get, .dtor = dtor, __VA_ARGS__ }; \
         gamma_register_new(&self); \
     }
 
+#define GAMMA(name) GAMMA_EXT(name)
+
 void gamma_register_new(gamma_plugin *plugin);
 double clamp(double x, double min, double max);
 int get_temp(const unsigned short R, const unsigned short B);
+const uint8_t *get_temp_factors(int temp);
 void fill_gamma_table(uint16_t *r, uint16_t *g, uint16_t *b, uint32_t ramp_size, int temp);
+void fill_scaled_gamma_table(uint16_t *r, uint16_t *g, uint16_t *b, uint32_t ramp_size, int temp, double scale);
+const uint16_t *get_gamma_ramp(uint32_t ramp_size, int temp, double scale);
+double gamma_output_scale(const char *output);
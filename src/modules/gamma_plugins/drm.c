@@ -2,12 +2,50 @@
 #include "gamma.h"
 #include "drm_utils.h"
 
+#define CTM_ONE     (1ULL << 32)    // 1.0 in S31.32 fixed point
+#define DEFAULT_VREFRESH    60
+
+typedef struct {
+    uint32_t id;
+    uint32_t ramp_size;         // legacy gamma size
+    uint32_t lut_prop;          // GAMMA_LUT property id, 0 if not exposed
+    uint32_t lut_size;          // GAMMA_LUT_SIZE property value
+    uint32_t blob;              // GAMMA_LUT or CTM blob created during current step
+    uint32_t ctm_prop;          // CTM property id, 0 if not exposed
+    char output[32];            // connector driven by the crtc, if any
+    double scale;               // its brightness scale during current step
+} drm_gamma_crtc;
+
 typedef struct {
     int fd;
     drmModeRes *res;
+    drm_gamma_crtc *crtcs;
+    bool atomic;                // whether GAMMA_LUT of all crtcs can be set in a single atomic commit
+    bool ctm;                   // whether temperature is set through CTM of all crtcs instead
+    bool ctm_used;              // CTM was set by us, it needs to be reset when using GAMMA_LUT
+    struct drm_color_lut *lut;  // preallocated atomic lut of biggest GAMMA_LUT_SIZE
+    uint16_t *buf;              // preallocated r,g,b ramps of biggest gamma size, for get()
+    int vblank_pipe;            // index of first active crtc, whose vblanks pace smooth steps; -1 if none
+    int vrefresh;               // its refresh rate
+    bool master;                // whether we are holding DRM master for current transition
 } drm_gamma_priv;
 
-GAMMA("Drm");
+static int init_crtcs(drm_gamma_priv *priv);
+static void init_crtc_props(drm_gamma_priv *priv, drm_gamma_crtc *c);
+static void init_crtc_outputs(drm_gamma_priv *priv);
+static int set_atomic(drm_gamma_priv *priv, const int temp);
+static uint32_t shared_blob(drm_gamma_priv *priv, const int idx);
+static int create_lut_blob(drm_gamma_priv *priv, drm_gamma_crtc *c, const int temp);
+static int create_ctm_blob(drm_gamma_priv *priv, drm_gamma_crtc *c, const int temp);
+static int get_ctm(drm_gamma_priv *priv);
+static int vblank_fd(void *priv_data);
+static int schedule(void *priv_data, unsigned int wait_ms);
+static void handle_vblank(void *priv_data);
+static void end_transition(void *priv_data);
+static int set_legacy(drm_gamma_priv *priv, const int temp);
+
+GAMMA_EXT("Drm", .vblank_fd = vblank_fd, .schedule = schedule, .handle_vblank = handle_vblank,
+          .end_transition = end_transition);
 
 static int validate(const char *id, const char *env, void **priv_data) {
     int ret = WRONG_PLUGIN;
@@ -15,15 +53,23 @@ static int validate(const char *id, const char *env, void **priv_data) {
     if (fd < 0) {
         return ret;
     }
+    /* Opening a card nobody holds makes us master: leave it free until we actually set gamma */
+    drmDropMaster(fd);
     
     drmModeRes *res = drmModeGetResources(fd);
     if (res && res->count_crtcs > 0) {
-        *priv_data = malloc(sizeof(drm_gamma_priv));
+        *priv_data = calloc(1, sizeof(drm_gamma_priv));
         drm_gamma_priv *priv = (drm_gamma_priv *)*priv_data;
         if (priv) {
             priv->fd = fd;
             priv->res = res;
-            ret = 0;
+            ret = init_crtcs(priv);
+            if (ret != 0) {
+                free(priv->crtcs);
+                free(priv->lut);
+                free(priv);
+                *priv_data = NULL;
+            }
         } else {
             ret = -ENOMEM;
         }
@@ -42,41 +88,267 @@ static int validate(const char *id, const char *env, void **priv_data) {
     return ret;
 }
 
+/*
+ * Store crtcs ids, gamma sizes and GAMMA_LUT properties,
+ * and allocate buffers once, instead of on each step
+ */
+static int init_crtcs(drm_gamma_priv *priv) {
+    priv->crtcs = calloc(priv->res->count_crtcs, sizeof(drm_gamma_crtc));
+    if (!priv->crtcs) {
+        return -ENOMEM;
+    }
+    
+    /* Atomic client cap is needed to see and set GAMMA_LUT and CTM atomically */
+    priv->atomic = drmSetClientCap(priv->fd, DRM_CLIENT_CAP_ATOMIC, 1) == 0;
+    priv->ctm = priv->atomic;
+    
+    priv->vblank_pipe = -1;
+    uint32_t max_size = 0, max_lut_size = 0;
+    for (int i = 0; i < priv->res->count_crtcs; i++) {
+        drm_gamma_crtc *c = &priv->crtcs[i];
+        c->id = priv->res->crtcs[i];
+        drmModeCrtc *crtc_info = drmModeGetCrtc(priv->fd, c->id);
+        if (crtc_info) {
+            c->ramp_size = crtc_info->gamma_size;
+            if (priv->vblank_pipe == -1 && crtc_info->mode_valid) {
+                priv->vblank_pipe = i;
+                priv->vrefresh = crtc_info->mode.vrefresh ? crtc_info->mode.vrefresh : DEFAULT_VREFRESH;
+            }
+            drmModeFreeCrtc(crtc_info);
+        }
+        if (c->ramp_size > max_size) {
+            max_size = c->ramp_size;
+        }
+        
+        if (priv->ctm || priv->atomic) {
+            init_crtc_props(priv, c);
+            if (c->ctm_prop == 0) {
+                priv->ctm = false;
+            }
+            if (c->lut_prop == 0 || c->lut_size == 0) {
+                /* All crtcs must be settable in a single commit */
+                priv->atomic = false;
+            } else if (c->lut_size > max_lut_size) {
+                max_lut_size = c->lut_size;
+            }
+        }
+    }
+    if (max_size == 0) {
+        return UNSUPPORTED;
+    }
+    init_crtc_outputs(priv);
+    
+    if (priv->atomic) {
+        priv->lut = malloc(max_lut_size * sizeof(struct drm_color_lut));
+        if (!priv->lut) {
+            return -ENOMEM;
+        }
+    }
+    priv->buf = malloc(3 * max_size * sizeof(uint16_t));
+    if (!priv->buf) {
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+static void init_crtc_props(drm_gamma_priv *priv, drm_gamma_crtc *c) {
+    drmModeObjectProperties *props = drmModeObjectGetProperties(priv->fd, c->id, DRM_MODE_OBJECT_CRTC);
+    if (!props) {
+        return;
+    }
+    for (uint32_t j = 0; j < props->count_props; j++) {
+        drmModePropertyRes *prop = drmModeGetProperty(priv->fd, props->props[j]);
+        if (prop) {
+            if (!strcmp(prop->name, "GAMMA_LUT")) {
+                c->lut_prop = prop->prop_id;
+            } else if (!strcmp(prop->name, "GAMMA_LUT_SIZE")) {
+                c->lut_size = props->prop_values[j];
+            } else if (!strcmp(prop->name, "CTM")) {
+                c->ctm_prop = prop->prop_id;
+            }
+            drmModeFreeProperty(prop);
+        }
+    }
+    drmModeFreeObjectProperties(props);
+}
+
+/* Name crtcs after their connector, to apply per-output brightness scale */
+static void init_crtc_outputs(drm_gamma_priv *priv) {
+    for (int i = 0; i < priv->res->count_connectors; i++) {
+        drmModeConnector *conn = drmModeGetConnectorCurrent(priv->fd, priv->res->connectors[i]);
+        if (!conn) {
+            continue;
+        }
+        drmModeEncoder *enc = conn->encoder_id ? drmModeGetEncoder(priv->fd, conn->encoder_id) : NULL;
+        if (enc) {
+            for (int j = 0; j < priv->res->count_crtcs; j++) {
+                if (priv->crtcs[j].id == enc->crtc_id) {
+                    drm_connector_name(conn, priv->crtcs[j].output, sizeof(priv->crtcs[j].output));
+                }
+            }
+            drmModeFreeEncoder(enc);
+        }
+        drmModeFreeConnector(conn);
+    }
+}
+
 static int set(void *priv_data, const int temp) {
     drm_gamma_priv *priv = (drm_gamma_priv *)priv_data;
     
     int ret = 0;
     
-    if (drmSetMaster(priv->fd)) {
-        perror("SetMaster");
-        ret = -errno;
-        goto end;
+    /* Needed by both legacy and atomic commits: take it once, drop it in end_transition() */
+    if (!priv->master) {
+        if (drmSetMaster(priv->fd)) {
+            perror("SetMaster");
+            ret = -errno;
+            goto end;
+        }
+        priv->master = true;
     }
     
-    for (int i = 0; i < priv->res->count_crtcs && !ret; i++) {
-        int id = priv->res->crtcs[i];
-        drmModeCrtc *crtc_info = drmModeGetCrtc(priv->fd, id);
-        int ramp_size = crtc_info->gamma_size;
-        uint16_t *r = calloc(ramp_size, sizeof(uint16_t));
-        uint16_t *g = calloc(ramp_size, sizeof(uint16_t));
-        uint16_t *b = calloc(ramp_size, sizeof(uint16_t));
-        fill_gamma_table(r, g, b, ramp_size, temp);
-        ret = drmModeCrtcSetGamma(priv->fd, id, ramp_size, r, g, b);
+    if (priv->ctm) {
+        ret = set_atomic(priv, temp);
+        if (ret != 0 && ret != -ENOMEM) {
+            fprintf(stderr, "Atomic CTM commit failed: %s. Falling back to gamma ramps.\n", strerror(-ret));
+            priv->ctm = false;
+        } else if (ret == 0) {
+            priv->ctm_used = true;
+        }
+    }
+    if (!priv->ctm && priv->atomic) {
+        ret = set_atomic(priv, temp);
+        if (ret != 0 && ret != -ENOMEM) {
+            fprintf(stderr, "Atomic GAMMA_LUT commit failed: %s. Falling back to legacy gamma.\n", strerror(-ret));
+            priv->atomic = false;
+        }
+    }
+    if (!priv->ctm && !priv->atomic) {
+        ret = set_legacy(priv, temp);
+    }
+    
+    end:
+    return ret;
+}
+
+/* Commit CTM or GAMMA_LUT of all crtcs at once */
+static int set_atomic(drm_gamma_priv *priv, const int temp) {
+    drmModeAtomicReq *req = drmModeAtomicAlloc();
+    if (!req) {
+        return -ENOMEM;
+    }
+    
+    int ret = 0;
+    int i;
+    for (i = 0; i < priv->res->count_crtcs && !ret; i++) {
+        drm_gamma_crtc *c = &priv->crtcs[i];
+        c->scale = gamma_output_scale(c->output);
+        c->blob = shared_blob(priv, i);
+        if (!c->blob) {
+            ret = priv->ctm ? create_ctm_blob(priv, c, temp) : create_lut_blob(priv, c, temp);
+            if (ret) {
+                c->blob = 0;
+                break;
+            }
+        }
+        
+        if (priv->ctm) {
+            if (drmModeAtomicAddProperty(req, c->id, c->ctm_prop, c->blob) < 0) {
+                ret = -ENOMEM;
+            }
+        } else {
+            if (drmModeAtomicAddProperty(req, c->id, c->lut_prop, c->blob) < 0) {
+                ret = -ENOMEM;
+            }
+            /* Drop any previously set temperature matrix */
+            if (priv->ctm_used && c->ctm_prop && drmModeAtomicAddProperty(req, c->id, c->ctm_prop, 0) < 0) {
+                ret = -ENOMEM;
+            }
+        }
+    }
+    
+    if (!ret) {
+        ret = drmModeAtomicCommit(priv->fd, req, 0, NULL);
         if (ret) {
             ret = -errno;
-            perror("drmModeCrtcSetGamma");
         }
-        free(r);
-        free(g);
-        free(b);
-        drmModeFreeCrtc(crtc_info);
     }
     
-    if (drmDropMaster(priv->fd)) {
-        perror("DropMaster");
+    /* Committed state holds its own reference to blobs */
+    for (int j = 0; j < i; j++) {
+        drm_gamma_crtc *c = &priv->crtcs[j];
+        bool owner = c->blob != 0;
+        for (int k = 0; k < j && owner; k++) {
+            owner = priv->crtcs[k].blob != c->blob;
+        }
+        if (owner) {
+            drmModeDestroyPropertyBlob(priv->fd, c->blob);
+        }
+    }
+    drmModeAtomicFree(req);
+    return ret;
+}
+
+/* Crtcs sharing scale (and lut size, for GAMMA_LUT) share the blob too */
+static uint32_t shared_blob(drm_gamma_priv *priv, const int idx) {
+    const drm_gamma_crtc *c = &priv->crtcs[idx];
+    for (int j = 0; j < idx; j++) {
+        const drm_gamma_crtc *o = &priv->crtcs[j];
+        if (o->blob && o->scale == c->scale && (priv->ctm || o->lut_size == c->lut_size)) {
+            return o->blob;
+        }
+    }
+    return 0;
+}
+        
+static int create_lut_blob(drm_gamma_priv *priv, drm_gamma_crtc *c, const int temp) {
+    const uint16_t *ramp = get_gamma_ramp(c->lut_size, temp, c->scale);
+    if (!ramp) {
+        return -ENOMEM;
+    }
+    for (uint32_t k = 0; k < c->lut_size; k++) {
+        priv->lut[k].red = ramp[k];
+        priv->lut[k].green = ramp[k + c->lut_size];
+        priv->lut[k].blue = ramp[k + 2 * c->lut_size];
+        priv->lut[k].reserved = 0;
+    }
+    return drmModeCreatePropertyBlob(priv->fd, priv->lut, c->lut_size * sizeof(struct drm_color_lut), &c->blob);
+}
+
+/*
+ * Temperature is just a per-channel scale: a diagonal 3x3 matrix (72 bytes),
+ * leaving GAMMA_LUT untouched.
+ */
+static int create_ctm_blob(drm_gamma_priv *priv, drm_gamma_crtc *c, const int temp) {
+    const uint8_t *f = get_temp_factors(temp);
+    struct drm_color_ctm ctm = {{ 0 }};
+    for (int i = 0; i < 3; i++) {
+        /* S31.32 sign-magnitude; factors are always positive */
+        ctm.matrix[i * 4] = f[i] * c->scale * CTM_ONE / UINT8_MAX;
+    }
+    return drmModeCreatePropertyBlob(priv->fd, &ctm, sizeof(ctm), &c->blob);
+}
+
+static int set_legacy(drm_gamma_priv *priv, const int temp) {
+    int ret = 0;
+    for (int i = 0; i < priv->res->count_crtcs && !ret; i++) {
+        const uint32_t ramp_size = priv->crtcs[i].ramp_size;
+        if (ramp_size == 0) {
+            continue;
+        }
+        /* Crtcs sharing ramp size and scale will get the very same cached ramp */
+        const uint16_t *ramp = get_gamma_ramp(ramp_size, temp, gamma_output_scale(priv->crtcs[i].output));
+        if (!ramp) {
+            ret = -ENOMEM;
+            break;
+        }
+        ret = drmModeCrtcSetGamma(priv->fd, priv->crtcs[i].id, ramp_size,
+                                  ramp, ramp + ramp_size, ramp + 2 * ramp_size);
+        if (ret) {
+            ret = -errno;
+            perror("drmModeCrtcSetGamma");
+        }
     }
-    
-    end:
     return ret;
 }
 
@@ -85,31 +357,113 @@ static int get(void *priv_data) {
     
     int temp = -1;
     
-    int id = priv->res->crtcs[0];
-    drmModeCrtc *crtc_info = drmModeGetCrtc(priv->fd, id);
-    int ramp_size = crtc_info->gamma_size;
+    if (priv->ctm) {
+        return get_ctm(priv);
+    }
     
-    uint16_t *red = calloc(ramp_size, sizeof(uint16_t));
-    uint16_t *green = calloc(ramp_size, sizeof(uint16_t));
-    uint16_t *blue = calloc(ramp_size, sizeof(uint16_t));
+    /* Legacy readback works for atomic GAMMA_LUT too */
+    const uint32_t ramp_size = priv->crtcs[0].ramp_size;
+    if (ramp_size == 0) {
+        return temp;
+    }
+    uint16_t *red = priv->buf;
+    uint16_t *green = priv->buf + ramp_size;
+    uint16_t *blue = priv->buf + 2 * ramp_size;
     
-    int r = drmModeCrtcGetGamma(priv->fd, id, ramp_size, red, green, blue);
+    int r = drmModeCrtcGetGamma(priv->fd, priv->crtcs[0].id, ramp_size, red, green, blue);
     if (r) {
-        perror("drmModeCrtcSetGamma");
+        perror("drmModeCrtcGetGamma");
     } else {
         temp = get_temp(clamp(red[1], 0, 255), clamp(blue[1], 0, 255));
     }
-    
-    free(red);
-    free(green);
-    free(blue);
-    
-    drmModeFreeCrtc(crtc_info);
     return temp;
 }
 
+/*
+ * Read back temperature from first crtc matrix diagonal,
+ * dividing out the brightness scale we folded into it.
+ * No matrix at all is identity, ie: 6500K.
+ */
+static int get_ctm(drm_gamma_priv *priv) {
+    int temp = -1;
+    drmModeObjectProperties *props = drmModeObjectGetProperties(priv->fd, priv->crtcs[0].id, DRM_MODE_OBJECT_CRTC);
+    if (!props) {
+        return temp;
+    }
+    for (uint32_t j = 0; j < props->count_props; j++) {
+        if (props->props[j] == priv->crtcs[0].ctm_prop) {
+            if (props->prop_values[j] == 0) {
+                temp = get_temp(UINT8_MAX, UINT8_MAX);
+                break;
+            }
+            drmModePropertyBlobRes *blob = drmModeGetPropertyBlob(priv->fd, props->prop_values[j]);
+            if (blob && blob->length >= sizeof(struct drm_color_ctm)) {
+                const struct drm_color_ctm *ctm = blob->data;
+                const double scale = gamma_output_scale(priv->crtcs[0].output);
+                const double R = (double)ctm->matrix[0] * UINT8_MAX / CTM_ONE / scale;
+                const double B = (double)ctm->matrix[8] * UINT8_MAX / CTM_ONE / scale;
+                temp = get_temp(clamp(R + 0.5, 0, 255), clamp(B + 0.5, 0, 255));
+            }
+            if (blob) {
+                drmModeFreePropertyBlob(blob);
+            }
+            break;
+        }
+    }
+    drmModeFreeObjectProperties(props);
+    return temp;
+}
+
+static int vblank_fd(void *priv_data) {
+    drm_gamma_priv *priv = (drm_gamma_priv *)priv_data;
+    return priv->vblank_pipe >= 0 ? priv->fd : -1;
+}
+
+/* Request an event N vblanks from now, N being the number of frames in wait_ms (at least 1) */
+static int schedule(void *priv_data, unsigned int wait_ms) {
+    drm_gamma_priv *priv = (drm_gamma_priv *)priv_data;
+    if (priv->vblank_pipe < 0) {
+        return -ENODEV;
+    }
+    
+    drmVBlank vbl = {{ 0 }};
+    vbl.request.type = DRM_VBLANK_RELATIVE | DRM_VBLANK_EVENT;
+    if (priv->vblank_pipe == 1) {
+        vbl.request.type |= DRM_VBLANK_SECONDARY;
+    } else if (priv->vblank_pipe > 1) {
+        vbl.request.type |= (priv->vblank_pipe << DRM_VBLANK_HIGH_CRTC_SHIFT) & DRM_VBLANK_HIGH_CRTC_MASK;
+    }
+    const unsigned int frames = ((uint64_t)wait_ms * priv->vrefresh + 500) / 1000;
+    vbl.request.sequence = frames > 0 ? frames : 1;
+    if (drmWaitVBlank(priv->fd, &vbl)) {
+        return -errno;
+    }
+    return 0;
+}
+
+static void handle_vblank(void *priv_data) {
+    drm_gamma_priv *priv = (drm_gamma_priv *)priv_data;
+    /* We only need the event to be consumed */
+    drmEventContext ctx = { .version = 2 };
+    drmHandleEvent(priv->fd, &ctx);
+}
+
+/* Let the compositor (or anyone else) take master back between transitions */
+static void end_transition(void *priv_data) {
+    drm_gamma_priv *priv = (drm_gamma_priv *)priv_data;
+    if (priv->master) {
+        if (drmDropMaster(priv->fd)) {
+            perror("DropMaster");
+        }
+        priv->master = false;
+    }
+}
+
 static int dtor(void *priv_data) {
     drm_gamma_priv *priv = (drm_gamma_priv *)priv_data;
     drmModeFreeResources(priv->res);
+    free(priv->crtcs);
+    free(priv->lut);
+    free(priv->buf);
     return close(priv->fd);
 }
@@ -1,13 +1,20 @@
 #include "wlr-gamma-control-unstable-v1-client-protocol.h"
 #include "gamma.h"
 #include "wl_utils.h"
+#include <poll.h>
 
+/*
+ * Each output has 2 gamma tables, used alternatively:
+ * a table being written for next step is never the one
+ * compositor may still be reading for previous one.
+ */
 struct output {
     struct wl_output *wl_output;
     struct zwlr_gamma_control_v1 *gamma_control;
     uint32_t ramp_size;
-    int table_fd;
-    uint16_t *table;
+    int table_fd[2];
+    uint16_t *table[2];
+    int cur;                    // table in use by last commit
     struct wl_list link;
 };
 
@@ -20,6 +27,7 @@ typedef struct {
 
 static int create_gamma_table(uint32_t ramp_size, uint16_t **table);
 static void destroy_output(struct output *output);
+static void commit_table(struct output *output, int idx);
 static void gamma_control_handle_gamma_size(void *data, 
                                             struct zwlr_gamma_control_v1 *gamma_control, uint32_t ramp_size);
 static void gamma_control_handle_failed(void *data,
@@ -28,6 +36,7 @@ static void registry_handle_global(void *data, struct wl_registry *registry,
                                    uint32_t name, const char *interface, uint32_t version);
 static void registry_handle_global_remove(void *data,
                                           struct wl_registry *registry, uint32_t name);
+static bool is_alive(void *priv_data);
 
 static const struct zwlr_gamma_control_v1_listener gamma_control_listener = {
     .gamma_size = gamma_control_handle_gamma_size,
@@ -39,7 +48,7 @@ static const struct wl_registry_listener registry_listener = {
     .global_remove = registry_handle_global_remove,
 };
 
-GAMMA("Wl");
+GAMMA_EXT("Wl", .is_alive = is_alive);
 
 static int validate(const char *id, const char *env,  void **priv_data) {
     struct wl_display *display = fetch_wl_display(id, env);
@@ -83,7 +92,7 @@ static int validate(const char *id, const char *env,  void **priv_data) {
     
     /* Check that all outputs were init correctly */
     wl_list_for_each(output, &priv->outputs, link) {
-        if (output->wl_output == NULL || output->table == NULL) {
+        if (output->wl_output == NULL || output->table[0] == NULL || output->table[1] == NULL) {
             fprintf(stderr, "failed to create gamma table\n");
             goto err;
         }
@@ -102,15 +111,20 @@ static int set(void *priv_data, const int temp) {
     
     struct output *output;
     wl_list_for_each(output, &priv->outputs, link) {
-        uint16_t *r = output->table;
-        uint16_t *g = output->table + output->ramp_size;
-        uint16_t *b = output->table + 2 * output->ramp_size;
+        const int idx = !output->cur;
+        uint16_t *r = output->table[idx];
+        uint16_t *g = output->table[idx] + output->ramp_size;
+        uint16_t *b = output->table[idx] + 2 * output->ramp_size;
         fill_gamma_table(r, g, b, output->ramp_size, temp);
-        zwlr_gamma_control_v1_set_gamma(output->gamma_control,
-                                        output->table_fd);
+        commit_table(output, idx);
+        output->cur = idx;
     }
-    wl_display_flush(priv->dpy);
-    return 0;
+    /* No roundtrip: just send requests, as smooth transitions call us on each step */
+    if (wl_display_flush(priv->dpy) == -1 && errno != EAGAIN) {
+        return -errno;
+    }
+    const int err = wl_display_get_error(priv->dpy);
+    return err ? -err : 0;
 }
 
 static int get(void *priv_data) {
@@ -137,6 +151,16 @@ static int dtor(void *priv_data) {
     return 0;
 }
 
+/* We never read events: check the socket ourselves, as libwayland only notices through failed IO */
+static bool is_alive(void *priv_data) {
+    wlr_gamma_priv *priv = (wlr_gamma_priv *)priv_data;
+    if (wl_display_get_error(priv->dpy)) {
+        return false;
+    }
+    struct pollfd p = { .fd = wl_display_get_fd(priv->dpy), .events = POLLIN };
+    return poll(&p, 1, 0) != 1 || !(p.revents & (POLLHUP | POLLERR));
+}
+
 static int create_gamma_table(uint32_t ramp_size, uint16_t **table) {
     size_t table_size = ramp_size * 3 * sizeof(uint16_t);
     int fd = create_anonymous_file(table_size, "clightd-gamma-wlr");
@@ -156,13 +180,25 @@ static int create_gamma_table(uint32_t ramp_size, uint16_t **table) {
     return fd;
 }
 
+/*
+ * Compositor reads the table from the current fd offset, which is shared
+ * with the fd it received (libwayland dups it): rewind it before each commit.
+ * Tables being double buffered, compositor is done with this one by now.
+ */
+static void commit_table(struct output *output, int idx) {
+    lseek(output->table_fd[idx], 0, SEEK_SET);
+    zwlr_gamma_control_v1_set_gamma(output->gamma_control, output->table_fd[idx]);
+}
+
 static void destroy_output(struct output *output) {
     size_t table_size = output->ramp_size * 3 * sizeof(uint16_t);
-    if (output->table) {
-        munmap(output->table, table_size);
-    }
-    if (output->table_fd != -1) {
-        close(output->table_fd);
+    for (int i = 0; i < 2; i++) {
+        if (output->table[i]) {
+            munmap(output->table[i], table_size);
+        }
+        if (output->table_fd[i] != -1) {
+            close(output->table_fd[i]);
+        }
     }
     if (output->wl_output) {
         wl_output_destroy(output->wl_output);
@@ -177,7 +213,9 @@ static void gamma_control_handle_gamma_size(void *data,
                                             struct zwlr_gamma_control_v1 *gamma_control, uint32_t ramp_size) {
     struct output *output = data;
     output->ramp_size = ramp_size;
-    output->table_fd = create_gamma_table(ramp_size, &output->table);
+    for (int i = 0; i < 2; i++) {
+        output->table_fd[i] = create_gamma_table(ramp_size, &output->table[i]);
+    }
 }
 
 static void gamma_control_handle_failed(void *data,
@@ -190,6 +228,7 @@ static void registry_handle_global(void *data, struct wl_registry *registry,
     wlr_gamma_priv *priv = (wlr_gamma_priv *)data;
     if (strcmp(interface, wl_output_interface.name) == 0) {
         struct output *output = calloc(1, sizeof(struct output));
+        output->table_fd[0] = output->table_fd[1] = -1;
         output->wl_output = wl_registry_bind(registry, name,
             &wl_output_interface, 1);
         wl_list_insert(&priv->outputs, &output->link);
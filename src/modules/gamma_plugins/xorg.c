@@ -1,13 +1,34 @@
 #include "gamma.h"
 #include <commons.h>
+#include <X11/Xatom.h>
 #include <X11/extensions/Xrandr.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include "drm_utils.h"
+
+typedef struct {
+    RRCrtc id;
+    XRRCrtcGamma *gamma;        // preallocated ramps, gamma size long
+    char output[32];            // kernel name of first connector driven by the crtc
+} xorg_gamma_crtc;
 
 typedef struct {
     Display *dpy;
+    Window root;
     XRRScreenResources *res;
+    int event_base;
+    int num_crtcs;              // active crtcs with a gamma ramp
+    xorg_gamma_crtc *crtcs;
 } xorg_gamma_priv;
 
-GAMMA("Xorg");
+static int refresh_crtcs(xorg_gamma_priv *priv);
+static void free_crtcs(xorg_gamma_priv *priv);
+static void get_output_name(xorg_gamma_priv *priv, const XRRCrtcInfo *info, char *name, const size_t size);
+static void handle_events(xorg_gamma_priv *priv);
+static void io_error_exit_handler(Display *dpy, void *userdata);
+static bool is_alive(void *priv_data);
+
+GAMMA_EXT("Xorg", .is_alive = is_alive);
 
 static int validate(const char *id, const char *env, void **priv_data) {
     int ret = WRONG_PLUGIN;
@@ -16,15 +37,27 @@ static int validate(const char *id, const char *env, void **priv_data) {
     
     Display *dpy = XOpenDisplay(id);
     if (dpy) {
+        /* Clients are kept around: X server may go away in the meantime */
+        XSetIOErrorExitHandler(dpy, io_error_exit_handler, NULL);
         int screen = DefaultScreen(dpy);
         Window root = RootWindow(dpy, screen);
-        XRRScreenResources *res = XRRGetScreenResourcesCurrent(dpy, root);
-        if (res) {
+        int event_base, error_base;
+        if (XRRQueryExtension(dpy, &event_base, &error_base)) {
             *priv_data = calloc(1, sizeof(xorg_gamma_priv));
             xorg_gamma_priv *priv = (xorg_gamma_priv *)*priv_data;
             priv->dpy = dpy;
-            priv->res = res;
-            ret = 0;
+            priv->root = root;
+            priv->event_base = event_base;
+            ret = refresh_crtcs(priv);
+            if (ret == 0) {
+                /* Get notified about crtcs being enabled, disabled or reconfigured */
+                XRRSelectInput(dpy, root, RRScreenChangeNotifyMask | RRCrtcChangeNotifyMask);
+            } else {
+                free_crtcs(priv);
+                free(priv);
+                *priv_data = NULL;
+                XCloseDisplay(dpy);
+            }
         } else {
             ret = UNSUPPORTED;
             XCloseDisplay(dpy);
@@ -35,26 +68,173 @@ static int validate(const char *id, const char *env, void **priv_data) {
     return ret;
 }
 
-static int set(void *priv_data, const int temp) {
-    xorg_gamma_priv *priv = (xorg_gamma_priv *)priv_data;
+/*
+ * Cache active crtcs and their preallocated gamma ramps,
+ * so that each step does not need any round trip to X server.
+ */
+static int refresh_crtcs(xorg_gamma_priv *priv) {
+    free_crtcs(priv);
+    
+    priv->res = XRRGetScreenResourcesCurrent(priv->dpy, priv->root);
+    if (!priv->res) {
+        return UNSUPPORTED;
+    }
+    priv->crtcs = calloc(priv->res->ncrtc, sizeof(xorg_gamma_crtc));
+    if (!priv->crtcs && priv->res->ncrtc > 0) {
+        return -ENOMEM;
+    }
     
     for (int i = 0; i < priv->res->ncrtc; i++) {
-        const int crtcxid = priv->res->crtcs[i];
+        const RRCrtc crtcxid = priv->res->crtcs[i];
+        XRRCrtcInfo *info = XRRGetCrtcInfo(priv->dpy, priv->res, crtcxid);
+        const bool active = info && info->mode != None && info->noutput > 0;
+        if (!active) {
+            if (info) {
+                XRRFreeCrtcInfo(info);
+            }
+            continue;
+        }
+        
         const int size = XRRGetCrtcGammaSize(priv->dpy, crtcxid);
-        XRRCrtcGamma *crtc_gamma = XRRAllocGamma(size);
-        fill_gamma_table(crtc_gamma->red, crtc_gamma->green, crtc_gamma->blue, size, temp);
-        XRRSetCrtcGamma(priv->dpy, crtcxid, crtc_gamma);
-        XFree(crtc_gamma);
+        if (size > 0) {
+            xorg_gamma_crtc *c = &priv->crtcs[priv->num_crtcs];
+            c->gamma = XRRAllocGamma(size);
+            if (c->gamma) {
+                c->id = crtcxid;
+                get_output_name(priv, info, c->output, sizeof(c->output));
+                priv->num_crtcs++;
+            }
+        }
+        XRRFreeCrtcInfo(info);
     }
     return 0;
 }
 
+/*
+ * Output scales are keyed by kernel connector names, while RandR output names depend on DDX driver
+ * (eg: HDMI-1 for modesetting, DisplayPort-0 for amdgpu):
+ * map first output of the crtc through its CONNECTOR_ID property, exposed by KMS based drivers,
+ * on the card whose connector drives the same mode.
+ * Fallback to RandR name otherwise.
+ */
+static void get_output_name(xorg_gamma_priv *priv, const XRRCrtcInfo *info, char *name, const size_t size) {
+    name[0] = '\0';
+    
+    const RROutput output = info->outputs[0];
+    const XRRModeInfo *mode = NULL;
+    for (int i = 0; i < priv->res->nmode && !mode; i++) {
+        if (priv->res->modes[i].id == info->mode) {
+            mode = &priv->res->modes[i];
+        }
+    }
+    
+    const Atom conn_atom = XInternAtom(priv->dpy, "CONNECTOR_ID", True);
+    if (conn_atom != None && mode) {
+        Atom type;
+        int format;
+        unsigned long nitems, bytes_after;
+        unsigned char *prop = NULL;
+        if (XRRGetOutputProperty(priv->dpy, output, conn_atom, 0, 1, False, False, AnyPropertyType,
+                                 &type, &format, &nitems, &bytes_after, &prop) == Success && prop) {
+            /* Format 32 properties are returned as longs */
+            if (type == XA_INTEGER && format == 32 && nitems == 1) {
+                drm_find_connector_name(*(long *)prop, mode->width, mode->height, name, size);
+            }
+            XFree(prop);
+        }
+    }
+    
+    if (name[0] == '\0') {
+        XRROutputInfo *out = XRRGetOutputInfo(priv->dpy, priv->res, output);
+        if (out) {
+            snprintf(name, size, "%s", out->name);
+            XRRFreeOutputInfo(out);
+        }
+    }
+}
+
+static void free_crtcs(xorg_gamma_priv *priv) {
+    for (int i = 0; i < priv->num_crtcs; i++) {
+        XRRFreeGamma(priv->crtcs[i].gamma);
+    }
+    free(priv->crtcs);
+    priv->crtcs = NULL;
+    priv->num_crtcs = 0;
+    if (priv->res) {
+        XRRFreeScreenResources(priv->res);
+        priv->res = NULL;
+    }
+}
+
+/*
+ * Default one would exit(): by returning, Xlib just marks the connection as broken,
+ * so that XCloseDisplay can still free it.
+ */
+static void io_error_exit_handler(Display *dpy, void *userdata) {
+    
+}
+
+/* Check connection ourselves before issuing any request, as Xlib would only notice through IO errors */
+static bool is_alive(void *priv_data) {
+    xorg_gamma_priv *priv = (xorg_gamma_priv *)priv_data;
+    struct pollfd p = { .fd = ConnectionNumber(priv->dpy), .events = POLLIN };
+    if (poll(&p, 1, 0) == 1) {
+        char c;
+        if (p.revents & (POLLHUP | POLLERR) || recv(p.fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) <= 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void handle_events(xorg_gamma_priv *priv) {
+    bool changed = false;
+    while (XPending(priv->dpy)) {
+        XEvent ev;
+        XNextEvent(priv->dpy, &ev);
+        if (ev.type == priv->event_base + RRScreenChangeNotify) {
+            XRRUpdateConfiguration(&ev);
+            changed = true;
+        } else if (ev.type == priv->event_base + RRNotify &&
+                   ((XRRNotifyEvent *)&ev)->subtype == RRNotify_CrtcChange) {
+            changed = true;
+        }
+    }
+    
+    if (changed) {
+        refresh_crtcs(priv);
+    }
+}
+
+static int set(void *priv_data, const int temp) {
+    xorg_gamma_priv *priv = (xorg_gamma_priv *)priv_data;
+    
+    if (!is_alive(priv)) {
+        return -EIO;
+    }
+    handle_events(priv);
+    for (int i = 0; i < priv->num_crtcs; i++) {
+        XRRCrtcGamma *crtc_gamma = priv->crtcs[i].gamma;
+        fill_scaled_gamma_table(crtc_gamma->red, crtc_gamma->green, crtc_gamma->blue, crtc_gamma->size, temp,
+                                gamma_output_scale(priv->crtcs[i].output));
+        XRRSetCrtcGamma(priv->dpy, priv->crtcs[i].id, crtc_gamma);
+    }
+    /* Send all crtcs updates at once */
+    XFlush(priv->dpy);
+    return 0;
+}
+
 static int get(void *priv_data) {
     xorg_gamma_priv *priv = (xorg_gamma_priv *)priv_data;
     
     int temp = -1;
+    if (!is_alive(priv)) {
+        return temp;
+    }
+    handle_events(priv);
     if (priv->res && priv->res->ncrtc > 0) {
-        XRRCrtcGamma *crtc_gamma = XRRGetCrtcGamma(priv->dpy, priv->res->crtcs[0]);
+        const RRCrtc crtcxid = priv->num_crtcs > 0 ? priv->crtcs[0].id : priv->res->crtcs[0];
+        XRRCrtcGamma *crtc_gamma = XRRGetCrtcGamma(priv->dpy, crtcxid);
         const int size = crtc_gamma->size;
         const int g = (65535.0 * (size - 1) / size) / 255;
         temp = get_temp(clamp(crtc_gamma->red[size - 1] / g, 0, 255), clamp(crtc_gamma->blue[size - 1] / g, 0, 255));
@@ -65,6 +245,6 @@ static int get(void *priv_data) {
 
 static int dtor(void *priv_data) {
     xorg_gamma_priv *priv = (xorg_gamma_priv *)priv_data;
-    XRRFreeScreenResources(priv->res);
+    free_crtcs(priv);
     return XCloseDisplay(priv->dpy);
 }
@@ -1,10 +1,41 @@
 #ifdef SCREEN_PRESENT
 
 #include "screen.h"
+#include <polkit.h>
+#include <module/map.h>
+#include <math.h>
 
 #define MONITOR_ILL_MAX              255
+#define SMALL_FRAME_PIXELS           (320 * 240)    // eg: already downscaled frames; they are fully sampled
+#define WATCH_MIN_INTERVAL           100            // ms
+
+/* A display watched by a bus client, polled with its own timer */
+typedef struct {
+    char *sender;               // unique bus name that requested the watch
+    char *display;
+    char *env;
+    screen_plugin *plugin;
+    int fd;
+    unsigned int interval;      // ms
+    double threshold;           // min brightness change to emit Changed signal
+    double last;                // last emitted brightness, -1 if none
+} watch_client;
 
 static int method_getbrightness(sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
+static int method_gethistogram(sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
+static int method_getbrightnessall(sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
+static int method_watch(sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
+static int method_unwatch(sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
+static int method_getbrightnessregion(sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
+static int on_name_owner_changed(sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
+static void watch_key(const char *sender, const char *display, char *key, const size_t size);
+static void watch_dtor(void *data);
+
+static map_t *watchers;
+static int idle_fd = -1;        // periodically lets plugins release idle resources
+
+static frame_export *export;    // Set while a GetEmittedHistogram call is running
+static const screen_roi *roi;   // Set while a GetEmittedBrightnessRegion call is running
 
 static screen_plugin *plugins[SCREEN_NUM];
 static const char object_path[] = "/org/clightd/clightd/Screen";
@@ -12,6 +43,12 @@ static const char bus_interface[] = "org.clightd.clightd.Screen";
 static const sd_bus_vtable vtable[] = {
     SD_BUS_VTABLE_START(0),
     SD_BUS_METHOD("GetEmittedBrightness", "ss", "d", method_getbrightness, SD_BUS_VTABLE_UNPRIVILEGED),
+    SD_BUS_METHOD("GetEmittedHistogram", "ssb", "h", method_gethistogram, SD_BUS_VTABLE_UNPRIVILEGED),
+    SD_BUS_METHOD("GetEmittedBrightnessAll", "ss", "a(sd)", method_getbrightnessall, SD_BUS_VTABLE_UNPRIVILEGED),
+    SD_BUS_METHOD("GetEmittedBrightnessRegion", "ss(iiii)u", "d", method_getbrightnessregion, SD_BUS_VTABLE_UNPRIVILEGED),
+    SD_BUS_METHOD("Watch", "ssud", "b", method_watch, SD_BUS_VTABLE_UNPRIVILEGED),
+    SD_BUS_METHOD("Unwatch", "ss", "b", method_unwatch, SD_BUS_VTABLE_UNPRIVILEGED),
+    SD_BUS_SIGNAL("Changed", "sd", 0),
     SD_BUS_VTABLE_END
 };
 
@@ -49,15 +86,54 @@ static void init(void) {
     }
     if (r < 0) {
         m_log("Failed to issue method call: %s\n", strerror(-r));
+    } else {
+        watchers = map_new(true, watch_dtor);
+        idle_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+        if (idle_fd != -1) {
+            struct itimerspec timerValue = {{0}};
+            timerValue.it_value.tv_sec = SCREEN_IDLE_TIMEOUT;
+            timerValue.it_interval.tv_sec = SCREEN_IDLE_TIMEOUT;
+            timerfd_settime(idle_fd, 0, &timerValue, NULL);
+            m_register_fd(idle_fd, true, NULL);
+        }
+        /* Drop watches whose owner left the bus */
+        sd_bus_add_match(bus, NULL,
+                         "type='signal',sender='org.freedesktop.DBus',interface='org.freedesktop.DBus',member='NameOwnerChanged'",
+                         on_name_owner_changed, NULL);
     }
 }
 
 static void receive(const msg_t *msg, const void *userdata) {
-
+    if (msg && !msg->is_pubsub) {
+        uint64_t t;
+        // nonblocking mode!
+        read(msg->fd_msg->fd, &t, sizeof(uint64_t));
+        if (msg->fd_msg->fd == idle_fd) {
+            for (int i = 0; i < SCREEN_NUM; i++) {
+                if (plugins[i] && plugins[i]->release_idle) {
+                    plugins[i]->release_idle();
+                }
+            }
+            return;
+        }
+        
+        watch_client *wc = (watch_client *)msg->fd_msg->userptr;
+        
+        const int br = wc->plugin->watch ? wc->plugin->watch(wc->display, wc->env) : wc->plugin->get(wc->display, wc->env);
+        if (br >= 0) {
+            const double val = (double)br / MONITOR_ILL_MAX;
+            if (wc->last < 0 || fabs(val - wc->last) >= wc->threshold) {
+                wc->last = val;
+                /* Emit signal on both /Screen objpath, and /Screen/$Plugin */
+                sd_bus_emit_signal(bus, object_path, bus_interface, "Changed", "sd", wc->display, val);
+                sd_bus_emit_signal(bus, wc->plugin->obj_path, bus_interface, "Changed", "sd", wc->display, val);
+            }
+        }
+    }
 }
 
 static void destroy(void) {
-    
+    map_free(watchers);
 }
 
 void screen_register_new(screen_plugin *plugin) {
@@ -82,29 +158,115 @@ void screen_register_new(screen_plugin *plugin) {
     }
 }
 
-int rgb_frame_brightness(const uint8_t *data, const int width, const int height, const int stride) {
-    /*
-     * takes 1 pixel every div*div area 
-     * (div values > 8 will almost not give performance improvements)
-     */
-    int r = 0, g = 0, b = 0;
-    const int div = 8;
-    const int wmax = (double)width / div;
-    const int hmax = (double)height / div;
-    for (int i = 0; i < wmax; i++) {
-        for (int k = 0; k < hmax; k++) {
-            /* obtain r,g,b components */
-            const uint8_t *p = data + (i * div + k * div * stride);
-            r += p[2] & 0xFF;
-            g += p[1] & 0xFF;
-            b += p[0] & 0xFF;
+const screen_roi *screen_get_roi(void) {
+    return roi;
+}
+
+/* For plugins whose last captured frame was bottom-up */
+void screen_flip_export(void) {
+    if (export) {
+        frame_export_flip(export);
+    }
+}
+
+/* Intersect roi with a width x height frame; returns -EINVAL if they do not overlap */
+int screen_clip_roi(const screen_roi *roi, const int width, const int height, screen_roi *out) {
+    *out = *roi;
+    if (out->x < 0) {
+        out->w += out->x;
+        out->x = 0;
+    }
+    if (out->y < 0) {
+        out->h += out->y;
+        out->y = 0;
+    }
+    if (out->x + out->w > width) {
+        out->w = width - out->x;
+    }
+    if (out->y + out->h > height) {
+        out->h = height - out->y;
+    }
+    if (out->w <= 0 || out->h <= 0) {
+        return -EINVAL;
+    }
+    return 0;
+}
+
+int rgb_frame_brightness(const uint8_t *data, const int width, const int height, const int stride, const enum frame_formats fmt) {
+    const frame_t f = { data, width, height, stride, fmt };
+    if (roi && roi->step > 0) {
+        return frame_brightness(&f, roi->step, roi->step, export);
+    }
+    if (width * height <= SMALL_FRAME_PIXELS) {
+        return frame_brightness(&f, 1, 1, export);
+    }
+    return frame_brightness(&f, FRAME_DEF_XSTEP, FRAME_DEF_YSTEP, export);
+}
+
+/* Same as rgb_frame_brightness(), for tiles intersecting a damaged rectangle */
+int rgb_frame_damage(frame_tiles *tiles, const uint8_t *data, const int width, const int height, const int stride,
+                     const enum frame_formats fmt, const int x, const int y, const int w, const int h) {
+    const frame_t f = { data, width, height, stride, fmt };
+    if (width * height <= SMALL_FRAME_PIXELS) {
+        return frame_tiles_update(tiles, &f, 1, x, y, w, h);
+    }
+    return frame_tiles_update(tiles, &f, FRAME_DEF_YSTEP, x, y, w, h);
+}
+
+static int get_frame(screen_plugin *plugin, const char *display, const char *env) {
+    int br = WRONG_PLUGIN;
+    if (!plugin) {
+        for (int i = 0; i < SCREEN_NUM && br == WRONG_PLUGIN; i++) {
+            br = plugins[i]->get(display, env);
         }
+    } else {
+        br = plugin->get(display, env);
+    }
+    return br;
+}
+
+/*
+ * Plugins without multi output support return a single entry,
+ * named after requested display (or plugin name, if none).
+ */
+static int get_all_frames(screen_plugin *plugin, const char *display, const char *env, screen_output *outputs) {
+    int ret = WRONG_PLUGIN;
+    for (int i = 0; i < SCREEN_NUM && ret == WRONG_PLUGIN; i++) {
+        screen_plugin *p = plugin ? plugin : plugins[i];
+        if (p->get_all) {
+            ret = p->get_all(display, env, outputs, SCREEN_MAX_OUTPUTS);
+        } else {
+            ret = p->get(display, env);
+            if (ret >= 0) {
+                snprintf(outputs[0].name, sizeof(outputs[0].name), "%s",
+                         display && strlen(display) ? display : p->name);
+                outputs[0].br = ret;
+                ret = 1;
+            }
+        }
+        if (plugin) {
+            break;
+        }
+    }
+    return ret;
+}
+
+static void set_error(const int br, sd_bus_error *ret_error) {
+    switch (br) {
+    case -EINVAL:
+    case -EOPNOTSUPP:
+        sd_bus_error_set_errno(ret_error, -br);
+        break;
+    case COMPOSITOR_NO_PROTOCOL:
+        sd_bus_error_set_const(ret_error, SD_BUS_ERROR_FAILED, "Compositor does not support 'wlr-screencopy-unstable-v1' protocol.");
+        break;
+    case WRONG_PLUGIN:
+        sd_bus_error_set_const(ret_error, SD_BUS_ERROR_FAILED, "No plugin available for your configuration.");
+        break;
+    default:
+        sd_bus_error_set_errno(ret_error, EIO);
+        break;
     }
-    const int area = wmax * hmax;
-    r = (double)r / area;
-    g = (double)g / area;
-    b = (double)b / area;
-    return 0.299 * r + 0.587 * g + 0.114 * b;
 }
 
 static int method_getbrightness(sd_bus_message* m, void* userdata, sd_bus_error* ret_error) {
@@ -117,33 +279,263 @@ static int method_getbrightness(sd_bus_message* m, void* userdata, sd_bus_error*
         return r;
     }
     
-    screen_plugin *plugin = userdata;
-    int br = WRONG_PLUGIN;
-    if (!plugin) {
-        for (int i = 0; i < SCREEN_NUM && br == WRONG_PLUGIN; i++) {
-            br = plugins[i]->get(display, env);
+    int br = get_frame(userdata, display, env);
+    if (br < 0) {
+        set_error(br, ret_error);
+        return -EACCES;
+    }
+    return sd_bus_reply_method_return(m, "d", (double)br / MONITOR_ILL_MAX);
+}
+
+static int method_getbrightnessall(sd_bus_message* m, void* userdata, sd_bus_error* ret_error) {
+    const char *display = NULL, *env = NULL;
+    
+    /* Read the parameters */
+    int r = sd_bus_message_read(m, "ss", &display, &env);
+    if (r < 0) {
+        m_log("Failed to parse parameters: %s\n", strerror(-r));
+        return r;
+    }
+    
+    screen_output outputs[SCREEN_MAX_OUTPUTS] = {0};
+    const int num = get_all_frames(userdata, display, env, outputs);
+    if (num < 0) {
+        set_error(num, ret_error);
+        return -EACCES;
+    }
+    
+    sd_bus_message *reply = NULL;
+    sd_bus_message_new_method_return(m, &reply);
+    sd_bus_message_open_container(reply, SD_BUS_TYPE_ARRAY, "(sd)");
+    int valid = 0;
+    for (int i = 0; i < num; i++) {
+        /* Skip outputs whose capture failed */
+        if (outputs[i].br >= 0) {
+            sd_bus_message_append(reply, "(sd)", outputs[i].name, (double)outputs[i].br / MONITOR_ILL_MAX);
+            valid++;
         }
+    }
+    sd_bus_message_close_container(reply);
+    if (valid > 0) {
+        r = sd_bus_send(NULL, reply, NULL);
     } else {
-        br = plugin->get(display, env);
+        sd_bus_error_set_errno(ret_error, EIO);
+        r = -EIO;
     }
+    sd_bus_message_unref(reply);
+    return r;
+}
 
+/*
+ * Same as GetEmittedBrightness, only sampling (x, y, w, h) rectangle one pixel every step.
+ * Rectangle is pushed down to plugins, so that only requested pixels are transferred.
+ */
+static int method_getbrightnessregion(sd_bus_message* m, void* userdata, sd_bus_error* ret_error) {
+    const char *display = NULL, *env = NULL;
+    screen_roi r_roi = {0};
+    unsigned int step;
+    
+    /* It reads arbitrary screen regions: same as GetEmittedHistogram */
+    ASSERT_AUTH();
+    
+    /* Read the parameters */
+    int r = sd_bus_message_read(m, "ss(iiii)u", &display, &env, &r_roi.x, &r_roi.y, &r_roi.w, &r_roi.h, &step);
+    if (r < 0) {
+        m_log("Failed to parse parameters: %s\n", strerror(-r));
+        return r;
+    }
+    
+    if (r_roi.w <= 0 || r_roi.h <= 0 || step > INT_MAX) {
+        sd_bus_error_set_errno(ret_error, EINVAL);
+        return -EINVAL;
+    }
+    r_roi.step = step;
+    
+    roi = &r_roi;
+    int br = get_frame(userdata, display, env);
+    roi = NULL;
     if (br < 0) {
-        switch (br) {
-        case -EINVAL:
-            sd_bus_error_set_errno(ret_error, -br);
-            break;
-        case COMPOSITOR_NO_PROTOCOL:
-            sd_bus_error_set_const(ret_error, SD_BUS_ERROR_FAILED, "Compositor does not support 'wlr-screencopy-unstable-v1' protocol.");
-            break;
-        case WRONG_PLUGIN:
-            sd_bus_error_set_const(ret_error, SD_BUS_ERROR_FAILED, "No plugin available for your configuration.");
-            break;
-        case -EIO:
-            sd_bus_error_set_errno(ret_error, EIO);
-        }
+        set_error(br, ret_error);
         return -EACCES;
     }
     return sd_bus_reply_method_return(m, "d", (double)br / MONITOR_ILL_MAX);
 }
 
+/*
+ * Start emitting Changed signal for display, whenever its brightness moves by at least threshold.
+ * It is polled every interval ms; plugins supporting damage tracking
+ * avoid any capture when screen content did not change.
+ */
+static int method_watch(sd_bus_message* m, void* userdata, sd_bus_error* ret_error) {
+    const char *display = NULL, *env = NULL;
+    unsigned int interval;
+    double threshold;
+    
+    /* It keeps capturing screen content */
+    ASSERT_AUTH();
+    
+    /* Read the parameters */
+    int r = sd_bus_message_read(m, "ssud", &display, &env, &interval, &threshold);
+    if (r < 0) {
+        m_log("Failed to parse parameters: %s\n", strerror(-r));
+        return r;
+    }
+    
+    if (interval < WATCH_MIN_INTERVAL || threshold < 0.0 || threshold > 1.0) {
+        sd_bus_error_set_errno(ret_error, EINVAL);
+        return -EINVAL;
+    }
+    
+    char key[PATH_MAX + 1];
+    const char *sender = sd_bus_message_get_sender(m);
+    watch_key(sender, display, key, sizeof(key));
+    watch_client *wc = map_get(watchers, key);
+    if (!wc) {
+        /* Find out which plugin handles this display */
+        screen_plugin *plugin = userdata;
+        int br = WRONG_PLUGIN;
+        if (!plugin) {
+            for (int i = 0; i < SCREEN_NUM && br == WRONG_PLUGIN; i++) {
+                plugin = plugins[i];
+                br = plugin->get(display, env);
+            }
+        } else {
+            br = plugin->get(display, env);
+        }
+        if (br < 0) {
+            set_error(br, ret_error);
+            return -EACCES;
+        }
+        
+        wc = calloc(1, sizeof(watch_client));
+        if (!wc) {
+            return -ENOMEM;
+        }
+        wc->sender = strdup(sender ? sender : "");
+        wc->display = strdup(display);
+        wc->env = strdup(env);
+        wc->plugin = plugin;
+        wc->last = -1;
+        wc->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+        m_register_fd(wc->fd, true, wc);
+        map_put(watchers, key, wc);
+    }
+    wc->interval = interval;
+    wc->threshold = threshold;
+    
+    struct itimerspec timerValue = {{0}};
+    timerValue.it_value.tv_nsec = 1; // start right now
+    timerValue.it_interval.tv_sec = interval / 1000;
+    timerValue.it_interval.tv_nsec = 1000 * 1000 * (interval % 1000);
+    timerfd_settime(wc->fd, 0, &timerValue, NULL);
+    
+    m_log("Watching '%s' every %u ms.\n", wc->display, interval);
+    return sd_bus_reply_method_return(m, "b", true);
+}
+
+static int method_unwatch(sd_bus_message* m, void* userdata, sd_bus_error* ret_error) {
+    const char *display = NULL, *env = NULL;
+    
+    ASSERT_AUTH();
+    
+    /* Read the parameters */
+    int r = sd_bus_message_read(m, "ss", &display, &env);
+    if (r < 0) {
+        m_log("Failed to parse parameters: %s\n", strerror(-r));
+        return r;
+    }
+    
+    /* Only caller's own watch can be removed */
+    char key[PATH_MAX + 1];
+    watch_key(sd_bus_message_get_sender(m), display, key, sizeof(key));
+    r = map_remove(watchers, key);
+    return sd_bus_reply_method_return(m, "b", r == MAP_OK);
+}
+
+static void watch_key(const char *sender, const char *display, char *key, const size_t size) {
+    snprintf(key, size, "%s %s", sender ? sender : "", display);
+}
+
+static map_ret_code find_owned_watch(void *userdata, const char *key, void *data) {
+    char *name = (char *)userdata;
+    watch_client *wc = (watch_client *)data;
+    
+    if (wc->sender && !strcmp(wc->sender, name)) {
+        /* Return its key through userdata */
+        strncpy(name, key, PATH_MAX);
+        return MAP_FULL; // break iteration
+    }
+    return MAP_OK;
+}
+
+static int on_name_owner_changed(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+    const char *name = NULL, *old_owner = NULL, *new_owner = NULL;
+    
+    int r = sd_bus_message_read(m, "sss", &name, &old_owner, &new_owner);
+    if (r < 0 || name[0] != ':' || new_owner[0] != '\0') {
+        return 0;
+    }
+    
+    char buf[PATH_MAX + 1] = {0};
+    strncpy(buf, name, PATH_MAX);
+    while (map_iterate(watchers, find_owned_watch, buf) == MAP_FULL) {
+        m_log("Dropping watch '%s' as its owner left.\n", buf);
+        map_remove(watchers, buf);
+        strncpy(buf, name, PATH_MAX);
+    }
+    return 0;
+}
+
+static void watch_dtor(void *data) {
+    watch_client *wc = (watch_client *)data;
+    m_deregister_fd(wc->fd); // this will close fd
+    free(wc->sender);
+    free(wc->display);
+    free(wc->env);
+    free(wc);
+}
+
+/*
+ * Return luminance histogram of screen content (and a downscaled greyscale frame, if requested)
+ * through a sealed memfd; see frame_utils.h for its layout.
+ */
+static int method_gethistogram(sd_bus_message* m, void* userdata, sd_bus_error* ret_error) {
+    const char *display = NULL, *env = NULL;
+    int with_frame;
+    
+    /* It exports screen content: same as Sensor.CaptureHistogram */
+    ASSERT_AUTH();
+    
+    /* Read the parameters */
+    int r = sd_bus_message_read(m, "ssb", &display, &env, &with_frame);
+    if (r < 0) {
+        m_log("Failed to parse parameters: %s\n", strerror(-r));
+        return r;
+    }
+    
+    frame_export ex = { .with_frame = with_frame };
+    export = &ex;
+    int br = get_frame(userdata, display, env);
+    export = NULL;
+    if (br >= 0 && !ex.filled) {
+        br = -ENOMEM;
+    }
+    
+    if (br >= 0) {
+        int fd = frame_export_to_memfd(&ex);
+        if (fd >= 0) {
+            r = sd_bus_reply_method_return(m, "h", fd);
+            close(fd); // sd-bus duplicates it
+        } else {
+            sd_bus_error_set_errno(ret_error, -fd);
+            r = fd;
+        }
+    } else {
+        set_error(br, ret_error);
+        r = -EACCES;
+    }
+    free(ex.frame);
+    return r;
+}
+
 #endif
@@ -1,9 +1,11 @@
 #include "commons.h"
+#include "frame_utils.h"
 
 #define _SCREEN_PLUGINS \
     X(XORG, 0) \
     X(WL, 1) \
-    X(FB, 2)
+    X(FB, 2) \
+    X(DRM, 3)
 
 enum screen_plugins { 
 #define X(name, val) name = val,
@@ -12,18 +14,49 @@ enum screen_plugins {
     SCREEN_NUM
 };
 
+#define SCREEN_MAX_OUTPUTS 16
+#define SCREEN_IDLE_TIMEOUT 30  // seconds plugins may keep per display resources around, after their last use
+
+typedef struct {
+    char name[64];
+    int br;
+} screen_output;
+
+/* Region of interest, in pixels (output logical coordinates on Wayland) */
+typedef struct {
+    int x;
+    int y;
+    int w;
+    int h;
+    int step;       // sampling stride, 0 for default
+} screen_roi;
+
 typedef struct {
     const char *name;
     int (*get)(const char *id, const char *env);
+    /* Optional: capture every output, returning number of filled outputs */
+    int (*get_all)(const char *id, const char *env, screen_output *outputs, const int max);
+    /* Optional: like get, but only recompute what changed since previous call */
+    int (*watch)(const char *id, const char *env);
+    /* Optional: called every SCREEN_IDLE_TIMEOUT to release resources unused since then */
+    void (*release_idle)(void);
     char obj_path[100];
 } screen_plugin;
 
-#define SCREEN(name) \
+/* Optional callbacks are passed as designated initializers, eg: .watch = foo */
+#define SCREEN_EXT(plugin_name, ...) \
     static int get_frame_brightness(const char *id, const char *env); \
     static void _ctor_ register_gamma_plugin(void) { \
-        static screen_plugin self = { name, get_frame_brightness }; \
+        static screen_plugin self = { .name = plugin_name, .get = get_frame_brightness, __VA_ARGS__ }; \
         screen_register_new(&self); \
     }
 
+#define SCREEN(name) SCREEN_EXT(name)
+
 void screen_register_new(screen_plugin *plugin);
-int rgb_frame_brightness(const uint8_t *data, const int width, const int height, const int stride);
+const screen_roi *screen_get_roi(void);
+void screen_flip_export(void);
+int screen_clip_roi(const screen_roi *roi, const int width, const int height, screen_roi *out);
+int rgb_frame_brightness(const uint8_t *data, const int width, const int height, const int stride, const enum frame_formats fmt);
+int rgb_frame_damage(frame_tiles *tiles, const uint8_t *data, const int width, const int height, const int stride,
+                     const enum frame_formats fmt, const int x, const int y, const int w, const int h);
@@ -0,0 +1,177 @@
+#include "screen.h"
+#include "drm_utils.h"
+#include <drm_fourcc.h>
+#include <linux/dma-buf.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+/* A CPU mapping of a scanout buffer */
+typedef struct {
+    uint8_t *data;
+    size_t size;
+    int dmabuf_fd;              // -1 when mapped as a dumb buffer
+} drm_map;
+
+static int get_crtc_brightness(int fd, uint32_t fb_id);
+static int map_fb(int fd, const drmModeFB2 *fb, drm_map *map);
+static void unmap_fb(drm_map *map);
+static void close_handles(int fd, const drmModeFB2 *fb);
+static int get_frame_format(uint32_t pixel_format);
+
+static int get_all_frame_brightness(const char *id, const char *env, screen_output *outputs, const int max);
+
+SCREEN_EXT("Drm", .get_all = get_all_frame_brightness);
+
+/* Capture first active CRTC */
+static int get_frame_brightness(const char *id, const char *env) {
+    screen_output output;
+    int ret = get_all_frame_brightness(id, env, &output, 1);
+    if (ret > 0) {
+        return output.br;
+    }
+    return ret == 0 ? UNSUPPORTED : ret;
+}
+
+/*
+ * Sample the framebuffer currently scanned out by each active CRTC.
+ * Note that this needs CAP_SYS_ADMIN: drmModeGetFB2 does not return buffer handles otherwise.
+ */
+static int get_all_frame_brightness(const char *id, const char *env, screen_output *outputs, const int max) {
+    int fd = drm_open_card(id);
+    if (fd < 0) {
+        return WRONG_PLUGIN;
+    }
+    
+    int ret = 0;
+    drmModeRes *res = drmModeGetResources(fd);
+    if (res) {
+        for (int i = 0; i < res->count_crtcs && ret < max; i++) {
+            drmModeCrtc *crtc = drmModeGetCrtc(fd, res->crtcs[i]);
+            if (!crtc) {
+                continue;
+            }
+            if (crtc->mode_valid && crtc->buffer_id) {
+                snprintf(outputs[ret].name, sizeof(outputs[ret].name), "CRTC-%u", crtc->crtc_id);
+                outputs[ret].br = get_crtc_brightness(fd, crtc->buffer_id);
+                ret++;
+            }
+            drmModeFreeCrtc(crtc);
+        }
+        drmModeFreeResources(res);
+    } else {
+        /* Not a KMS device */
+        ret = WRONG_PLUGIN;
+    }
+    close(fd);
+    return ret;
+}
+
+static int get_crtc_brightness(int fd, uint32_t fb_id) {
+    drmModeFB2 *fb = drmModeGetFB2(fd, fb_id);
+    if (!fb) {
+        perror("drmModeGetFB2");
+        return -errno;
+    }
+    
+    int ret = UNSUPPORTED;
+    const int fmt = get_frame_format(fb->pixel_format);
+    if (!fb->handles[0]) {
+        fprintf(stderr, "No framebuffer handle: missing CAP_SYS_ADMIN.\n");
+        ret = -EACCES;
+    } else if ((fb->flags & DRM_MODE_FB_MODIFIERS) && fb->modifier != DRM_FORMAT_MOD_LINEAR) {
+        /* Tiled or compressed buffers cannot be sampled linearly */
+        fprintf(stderr, "Unsupported framebuffer modifier 0x%llx.\n", (unsigned long long)fb->modifier);
+    } else if (fmt < 0) {
+        fprintf(stderr, "Unsupported framebuffer format 0x%x.\n", fb->pixel_format);
+    } else {
+        screen_roi area = { 0, 0, fb->width, fb->height };
+        const screen_roi *roi = screen_get_roi();
+        drm_map map;
+        if (roi && screen_clip_roi(roi, fb->width, fb->height, &area) != 0) {
+            ret = -EINVAL;
+        } else if (map_fb(fd, fb, &map) == 0) {
+            /* Only sample requested rows; untouched pages are never faulted in */
+            const uint8_t *data = map.data + fb->offsets[0] + (size_t)area.y * fb->pitches[0] + area.x * frame_bpp(fmt);
+            ret = rgb_frame_brightness(data, area.w, area.h, fb->pitches[0], fmt);
+            unmap_fb(&map);
+        } else {
+            ret = -EIO;
+        }
+    }
+    close_handles(fd, fb);
+    drmModeFreeFB2(fb);
+    return ret;
+}
+
+/* Export buffer through PRIME; fallback at mapping it as a dumb buffer */
+static int map_fb(int fd, const drmModeFB2 *fb, drm_map *map) {
+    map->size = fb->offsets[0] + (size_t)fb->pitches[0] * fb->height;
+    map->dmabuf_fd = -1;
+    
+    int dmabuf_fd;
+    if (drmPrimeHandleToFD(fd, fb->handles[0], DRM_CLOEXEC, &dmabuf_fd) == 0) {
+        map->data = mmap(NULL, map->size, PROT_READ, MAP_SHARED, dmabuf_fd, 0);
+        if (map->data != MAP_FAILED) {
+            map->dmabuf_fd = dmabuf_fd;
+            struct dma_buf_sync sync = { .flags = DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ };
+            ioctl(dmabuf_fd, DMA_BUF_IOCTL_SYNC, &sync);
+            return 0;
+        }
+        close(dmabuf_fd);
+    }
+    
+    struct drm_mode_map_dumb mreq = { .handle = fb->handles[0] };
+    if (drmIoctl(fd, DRM_IOCTL_MODE_MAP_DUMB, &mreq) == 0) {
+        map->data = mmap(NULL, map->size, PROT_READ, MAP_SHARED, fd, mreq.offset);
+        if (map->data != MAP_FAILED) {
+            return 0;
+        }
+    }
+    fprintf(stderr, "Failed to map framebuffer: %m\n");
+    return -1;
+}
+
+static void unmap_fb(drm_map *map) {
+    if (map->dmabuf_fd != -1) {
+        struct dma_buf_sync sync = { .flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ };
+        ioctl(map->dmabuf_fd, DMA_BUF_IOCTL_SYNC, &sync);
+    }
+    munmap(map->data, map->size);
+    if (map->dmabuf_fd != -1) {
+        close(map->dmabuf_fd);
+    }
+}
+
+/* drmModeGetFB2 creates new GEM handles that must be closed; planes may share them */
+static void close_handles(int fd, const drmModeFB2 *fb) {
+    for (int i = 0; i < 4; i++) {
+        bool dup = false;
+        for (int j = 0; j < i && !dup; j++) {
+            dup = fb->handles[j] == fb->handles[i];
+        }
+        if (fb->handles[i] && !dup) {
+            struct drm_gem_close req = { .handle = fb->handles[i] };
+            drmIoctl(fd, DRM_IOCTL_GEM_CLOSE, &req);
+        }
+    }
+}
+
+static int get_frame_format(uint32_t pixel_format) {
+    switch (pixel_format) {
+    case DRM_FORMAT_ARGB8888:
+    case DRM_FORMAT_XRGB8888:
+        return FRAME_XRGB8888;
+    case DRM_FORMAT_ABGR8888:
+    case DRM_FORMAT_XBGR8888:
+        return FRAME_XBGR8888;
+    case DRM_FORMAT_ARGB2101010:
+    case DRM_FORMAT_XRGB2101010:
+        return FRAME_XRGB2101010;
+    case DRM_FORMAT_RGB888:
+        return FRAME_RGB888;
+    case DRM_FORMAT_RGB565:
+        return FRAME_RGB565;
+    default:
+        return -1;
+    }
+}
@@ -1,68 +1,166 @@
 #include "screen.h"
 #include <linux/fb.h> /* to handle framebuffer ioctls */
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <module/map.h>
 
 #define DEFAULT_FB "/dev/fb0"
 
+/*
+ * Each framebuffer device is kept open and mmapped between calls;
+ * it is only remapped when its geometry changes.
+ * Drivers that do not support mmap fall back to read().
+ */
+typedef struct {
+    int fd;
+    struct fb_var_screeninfo varinfo;   // geometry the mapping was created for
+    struct fb_fix_screeninfo fixinfo;
+    unsigned char *map;
+    size_t map_len;
+} fb_session;
+
+static fb_session *get_session(const char *id);
+static int update_session(fb_session *s);
+static bool geometry_changed(const struct fb_var_screeninfo *a, const struct fb_var_screeninfo *b);
 static int get_framebufferdata(int fd, struct fb_var_screeninfo *fb_varinfo_p, struct fb_fix_screeninfo *fb_fixedinfo);
 static int read_framebuffer(int fd, size_t bytes, unsigned char *buf_p, int skip_bytes);
+static int get_frame_format(const struct fb_var_screeninfo *fb_varinfo);
+static void session_dtor(void *data);
 
 SCREEN("Fb")
 
+static map_t *sessions;
+
+static void _dtor_ destroy_sessions(void) {
+    map_free(sessions);
+}
+
 /* Many thanks to fbgrab utility: https://github.com/GunnarMonell/fbgrab/blob/master/fbgrab.c */
 static int get_frame_brightness(const char *id, const char *env) {
      if (!id || !strlen(id)) {
          id = DEFAULT_FB;
     }
     
-    int ret = WRONG_PLUGIN;
-    unsigned char *buf_p = NULL;
-    int fd = open(id, O_RDONLY);
-    if (fd == -1) {
-        fprintf(stderr, "Error: Couldn't open %s.\n", id);
-        return ret;
+    fb_session *s = get_session(id);
+    if (!s) {
+        return WRONG_PLUGIN;
     }
     
-    ret = UNSUPPORTED;
-    struct fb_var_screeninfo fb_varinfo = {0};
-    struct fb_fix_screeninfo fb_fixedinfo = {0};
-    if (get_framebufferdata(fd, &fb_varinfo, &fb_fixedinfo) != 0) {
-        goto err;
+    if (update_session(s) != 0) {
+        /* Device went away: drop it; next call will reopen it */
+        map_remove(sessions, id);
+        return UNSUPPORTED;
     }
     
-    const int bitdepth = fb_varinfo.bits_per_pixel;
-    const int width = fb_varinfo.xres;
-    const int height = fb_varinfo.yres;
-    const int line_length = fb_fixedinfo.line_length / (bitdepth >> 3);
-    const int skip_bytes =  (fb_varinfo.yoffset * fb_varinfo.xres) * (bitdepth >> 3);
-    const int stride = fb_fixedinfo.line_length;
+    const struct fb_var_screeninfo *fb_varinfo = &s->varinfo;
+    const int bitdepth = fb_varinfo->bits_per_pixel;
+    const int stride = s->fixinfo.line_length;
+    const int line_length = stride / (bitdepth >> 3);
+    const int fmt = get_frame_format(fb_varinfo);
     
-    fprintf(stderr, "Fb resolution: %ix%i depth %i.\n", width, height, bitdepth);
-    
-    const size_t buf_size = height * stride;
-
-    if (line_length < width) {
+    if (line_length < (int)fb_varinfo->xres) {
         fprintf(stderr, "Line length cannot be smaller than width");
-        ret = -EINVAL;
+        return -EINVAL;
+    }
+    if (fmt < 0) {
+        fprintf(stderr, "Unsupported pixel format.\n");
+        return UNSUPPORTED;
+    }
+    
+    /* Only touch requested rows, if any */
+    screen_roi area = { 0, 0, fb_varinfo->xres, fb_varinfo->yres };
+    const screen_roi *roi = screen_get_roi();
+    if (roi && screen_clip_roi(roi, fb_varinfo->xres, fb_varinfo->yres, &area) != 0) {
+        return -EINVAL;
+    }
+    const int width = area.w;
+    const int height = area.h;
+    const size_t skip_bytes = (size_t)(fb_varinfo->yoffset + area.y) * stride + 
+                              (fb_varinfo->xoffset + area.x) * (bitdepth >> 3);
+    /* Last row only needs width pixels */
+    const size_t buf_size = (size_t)(height - 1) * stride + width * (bitdepth >> 3);
+    
+    if (s->map && skip_bytes + buf_size <= s->map_len) {
+        /* Sample straight from mapped video memory */
+        return rgb_frame_brightness(s->map + skip_bytes, width, height, stride, fmt);
+    }
+    
+    int ret;
+    unsigned char *buf_p = calloc(buf_size, sizeof(unsigned char));
+    if (buf_p == NULL) {
+        ret = -ENOMEM;
+    } else if (read_framebuffer(s->fd, buf_size, buf_p, skip_bytes) != 0) {
+        ret = -EAGAIN;
     } else {
-        buf_p = calloc(buf_size, sizeof(unsigned char));
-        if (buf_p == NULL) {
-            ret = -ENOMEM;
-            goto err;
+        ret = rgb_frame_brightness(buf_p, width, height, stride, fmt);
+    }
+    free(buf_p);
+    return ret;
+}
+
+static fb_session *get_session(const char *id) {
+    if (!sessions) {
+        sessions = map_new(true, session_dtor);
+    }
+    
+    fb_session *s = map_get(sessions, id);
+    if (!s) {
+        int fd = open(id, O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            fprintf(stderr, "Error: Couldn't open %s.\n", id);
+            return NULL;
         }
-        if (read_framebuffer(fd, buf_size, buf_p, skip_bytes) != 0) {
-            ret = -EAGAIN;
-        } else {
-            ret = rgb_frame_brightness(buf_p, line_length, height, stride);
+        
+        s = calloc(1, sizeof(fb_session));
+        if (!s) {
+            close(fd);
+            return NULL;
         }
+        s->fd = fd;
+        map_put(sessions, id, s);
     }
+    return s;
+}
 
-err:
-    free(buf_p);
-    if (fd != -1) {
-        close(fd);
+/* Refresh screen info, remapping the framebuffer if its geometry changed */
+static int update_session(fb_session *s) {
+    struct fb_var_screeninfo fb_varinfo = {0};
+    struct fb_fix_screeninfo fb_fixedinfo = {0};
+    if (get_framebufferdata(s->fd, &fb_varinfo, &fb_fixedinfo) != 0) {
+        return -1;
     }
-    return ret;
+    
+    const bool remap = !s->map_len || geometry_changed(&s->varinfo, &fb_varinfo) ||
+                       s->fixinfo.smem_len != fb_fixedinfo.smem_len ||
+                       s->fixinfo.line_length != fb_fixedinfo.line_length;
+    /* Always store new varinfo: offsets may change on panning without any remap */
+    s->varinfo = fb_varinfo;
+    s->fixinfo = fb_fixedinfo;
+    if (remap) {
+        fprintf(stderr, "Fb resolution: %ix%i depth %i.\n", fb_varinfo.xres, fb_varinfo.yres, fb_varinfo.bits_per_pixel);
+        
+        if (s->map) {
+            munmap(s->map, s->map_len);
+            s->map = NULL;
+        }
+        s->map_len = fb_fixedinfo.smem_len;
+        if (!s->map_len) {
+            s->map_len = (size_t)fb_varinfo.yres_virtual * fb_fixedinfo.line_length;
+        }
+        void *map = mmap(NULL, s->map_len, PROT_READ, MAP_SHARED, s->fd, 0);
+        if (map == MAP_FAILED) {
+            fprintf(stderr, "Failed to mmap framebuffer: %m. Falling back to read().\n");
+        } else {
+            s->map = map;
+        }
+    }
+    return 0;
+}
+
+static bool geometry_changed(const struct fb_var_screeninfo *a, const struct fb_var_screeninfo *b) {
+    return a->xres != b->xres || a->yres != b->yres ||
+           a->xres_virtual != b->xres_virtual || a->yres_virtual != b->yres_virtual ||
+           a->bits_per_pixel != b->bits_per_pixel;
 }
 
 static int get_framebufferdata(int fd, struct fb_var_screeninfo *fb_varinfo_p, struct fb_fix_screeninfo *fb_fixedinfo) {
@@ -76,14 +174,35 @@ static int get_framebufferdata(int fd, struct fb_var_screeninfo *fb_varinfo_p, s
     return 0;
 }
 
-static int read_framebuffer(int fd, size_t bytes, unsigned char *buf_p, int skip_bytes) {
-    if (skip_bytes) {
-        lseek(fd, skip_bytes, SEEK_SET);
+static int get_frame_format(const struct fb_var_screeninfo *fb_varinfo) {
+    switch (fb_varinfo->bits_per_pixel) {
+    case 32:
+        if (fb_varinfo->red.length == 10) {
+            return FRAME_XRGB2101010;
+        }
+        return fb_varinfo->red.offset == 0 ? FRAME_XBGR8888 : FRAME_XRGB8888;
+    case 24:
+        return FRAME_RGB888;
+    case 16:
+        return FRAME_RGB565;
+    default:
+        return -1;
     }
+}
 
-    if (read(fd, buf_p, bytes) != (ssize_t) bytes) {
+static int read_framebuffer(int fd, size_t bytes, unsigned char *buf_p, int skip_bytes) {
+    if (pread(fd, buf_p, bytes, skip_bytes) != (ssize_t) bytes) {
         fprintf(stderr, "Error: Not enough memory or data\n");
         return -1;
     }
 	return 0;
 }
+
+static void session_dtor(void *data) {
+    fb_session *s = (fb_session *)data;
+    if (s->map) {
+        munmap(s->map, s->map_len);
+    }
+    close(s->fd);
+    free(s);
+}
@@ -1,43 +1,127 @@
 #include "screen.h"
 #include "wl_utils.h"
 #include "wlr-screencopy-unstable-v1-client-protocol.h"
+#include <module/map.h>
+#include <poll.h>
 
-static struct wl_buffer *create_shm_buffer(enum wl_shm_format fmt,
-        int width, int height, int stride, void **data_out);
-static void frame_handle_buffer(void *tt, struct zwlr_screencopy_frame_v1 *frame, uint32_t format,
-    uint32_t width, uint32_t height, uint32_t stride);
-static void frame_handle_flags(void*tt, struct zwlr_screencopy_frame_v1 *frame, uint32_t flags);
-static void frame_handle_ready(void *tt, struct zwlr_screencopy_frame_v1 *frame,
-    uint32_t tv_sec_hi, uint32_t tv_sec_low, uint32_t tv_nsec);
-static void frame_handle_failed(void *tt, struct zwlr_screencopy_frame_v1 *frame);
-static void handle_global(void *data, struct wl_registry *registry,
-        uint32_t name, const char *interface, uint32_t version);
-static void handle_global_remove(void *data, struct wl_registry *registry, uint32_t name);
-static void dtor(void);
+/* Same captured area as Xorg plugin */
+#define WL_FRAME_PCT      0.85
+#define WL_POOL_SIZE      2       // per output
+#define WL_MAX_OUTPUTS    8
+#define WL_MAX_DAMAGE     16      // damage rects kept for each watched frame; whole frame is recomputed when exceeded
 
-static struct {
+/* Version 4 is needed for name event */
+#ifdef WL_OUTPUT_NAME_SINCE_VERSION
+    #define WL_OUTPUT_VERSION   4
+#else
+    #define WL_OUTPUT_VERSION   2
+#endif
+
+/* Run before wl_utils destructor, that disconnects from displays */
+#define _session_dtor_    __attribute__((destructor (102)))
+
+typedef struct {
     struct wl_buffer *wl_buffer;
     void *data;
     enum wl_shm_format format;
     int width, height, stride;
+} shm_buffer;
+
+typedef struct wl_out wl_out;
+
+/* A screencopy frame request */
+typedef struct {
+    wl_out *out;
+    struct zwlr_screencopy_frame_v1 *frame;
+    shm_buffer *buffer;
     bool y_invert;
-} buffer;
+    bool with_damage;                       // wait for damage and track it (watch mode)
+    bool full_damage;
+    int num_damage;
+    struct { int x, y, w, h; } damage[WL_MAX_DAMAGE];
+    bool buffer_copy_done;
+    bool buffer_copy_err;
+} wl_capture;
+
+/* A bound output, with its own capture state and pool of shm buffers keyed by (format, width, height, stride) */
+struct wl_out {
+    struct wl_shm *shm;
+    struct wl_output *output;
+    uint32_t global_name;                   // output registry name, to detect its removal
+    char name[64];                          // output name, eg: DP-1, or make and model for old compositors
+    bool has_name;
+    /* Output mode, used to compute captured region in logical coordinates */
+    int width, height;
+    int scale;
+    int transform;
+    shm_buffer pool[WL_POOL_SIZE];
+    int pool_next;                          // next pool slot to be evicted
+    wl_capture cap;                         // current one-shot capture
+    /* Watch mode: a frame request is always kept pending, using its own buffer */
+    wl_capture watch;
+    shm_buffer watch_buf;
+    frame_tiles tiles;
+};
+
+/* Globals bound for each display, kept between calls */
+typedef struct {
+    struct wl_display *dpy;
+    struct wl_registry *registry;
+    struct zwlr_screencopy_manager_v1 *screencopy_manager;
+    struct wl_shm *shm;
+    wl_out outputs[WL_MAX_OUTPUTS];
+} wl_session;
+
+static wl_session *get_session(const char *id, const char *env);
+static int check_session(wl_session *s);
+static void start_capture(wl_session *s, wl_out *o, wl_capture *cap);
+static bool capture_pending(wl_session *s);
+static int end_capture(wl_capture *cap);
+static int update_watch(wl_out *o);
+static int dispatch_nonblock(struct wl_display *dpy);
+static void destroy_output(wl_out *o);
+static void release_output(struct wl_output *output);
+static shm_buffer *get_shm_buffer(wl_out *o, enum wl_shm_format fmt, int width, int height, int stride);
+static int create_shm_buffer(struct wl_shm *shm, shm_buffer *buf, enum wl_shm_format fmt,
+        int width, int height, int stride);
+static void destroy_shm_buffer(shm_buffer *buf);
+static void frame_handle_buffer(void *data, struct zwlr_screencopy_frame_v1 *frame, uint32_t format,
+    uint32_t width, uint32_t height, uint32_t stride);
+static void frame_handle_flags(void *data, struct zwlr_screencopy_frame_v1 *frame, uint32_t flags);
+static void frame_handle_ready(void *data, struct zwlr_screencopy_frame_v1 *frame,
+    uint32_t tv_sec_hi, uint32_t tv_sec_low, uint32_t tv_nsec);
+static void frame_handle_failed(void *data, struct zwlr_screencopy_frame_v1 *frame);
+static void frame_handle_damage(void *data, struct zwlr_screencopy_frame_v1 *frame,
+    uint32_t x, uint32_t y, uint32_t width, uint32_t height);
+static void handle_global(void *data, struct wl_registry *registry,
+        uint32_t name, const char *interface, uint32_t version);
+static void handle_global_remove(void *data, struct wl_registry *registry, uint32_t name);
+static void output_handle_geometry(void *data, struct wl_output *wl_output, int32_t x, int32_t y,
+        int32_t phys_w, int32_t phys_h, int32_t subpixel, const char *make, const char *model, int32_t transform);
+static void output_handle_mode(void *data, struct wl_output *wl_output, uint32_t flags,
+        int32_t width, int32_t height, int32_t refresh);
+static void output_handle_done(void *data, struct wl_output *wl_output);
+static void output_handle_scale(void *data, struct wl_output *wl_output, int32_t factor);
+#ifdef WL_OUTPUT_NAME_SINCE_VERSION
+static void output_handle_name(void *data, struct wl_output *wl_output, const char *name);
+static void output_handle_description(void *data, struct wl_output *wl_output, const char *description);
+#endif
+static void session_dtor(void *data);
+static int get_frame_format(enum wl_shm_format format);
 
-SCREEN("Wl");
+static int get_all_frame_brightness(const char *id, const char *env, screen_output *outputs, const int max);
+static int watch_frame_brightness(const char *id, const char *env);
 
-static struct zwlr_screencopy_manager_v1 *screencopy_manager;
-static struct wl_output *output;
-static struct wl_shm *shm;
-static struct wl_registry *registry;
-static struct zwlr_screencopy_frame_v1 *frame;
-static bool buffer_copy_done;
-static bool buffer_copy_err;
+SCREEN_EXT("Wl", .get_all = get_all_frame_brightness, .watch = watch_frame_brightness);
+
+static map_t *sessions;
 
 static const struct zwlr_screencopy_frame_v1_listener frame_listener = {
     .buffer = frame_handle_buffer,
     .flags = frame_handle_flags,
     .ready = frame_handle_ready,
     .failed = frame_handle_failed,
+    .damage = frame_handle_damage,
 };
 
 static const struct wl_registry_listener registry_listener = {
@@ -45,158 +129,594 @@ static const struct wl_registry_listener registry_listener = {
     .global_remove = handle_global_remove,
 };
 
+static const struct wl_output_listener output_listener = {
+    .geometry = output_handle_geometry,
+    .mode = output_handle_mode,
+    .done = output_handle_done,
+    .scale = output_handle_scale,
+#ifdef WL_OUTPUT_NAME_SINCE_VERSION
+    .name = output_handle_name,
+    .description = output_handle_description,
+#endif
+};
+
+static void _session_dtor_ destroy_sessions(void) {
+    map_free(sessions);
+}
+
+/* Capture first output */
 static int get_frame_brightness(const char *id, const char *env) {
+    wl_session *s = get_session(id, env);
+    if (s == NULL) {
+        return WRONG_PLUGIN;
+    }
+
+    int ret = check_session(s);
+    if (ret == 0) {
+        wl_out *o = NULL;
+        for (int i = 0; i < WL_MAX_OUTPUTS && !o; i++) {
+            if (s->outputs[i].output) {
+                o = &s->outputs[i];
+            }
+        }
+
+        start_capture(s, o, &o->cap);
+        int r = 0;
+        while (capture_pending(s) && (r = wl_display_dispatch(s->dpy)) != -1) {
+            // This space is intentionally left blank
+        }
+        ret = end_capture(&o->cap);
+
+        if (r == -1) {
+            /* Connection is broken; drop any bound global */
+            map_remove(sessions, id);
+        }
+    }
+    return ret;
+}
+
+/*
+ * Capture all outputs concurrently:
+ * every frame is requested before dispatching, so that total latency is the one of slowest output.
+ */
+static int get_all_frame_brightness(const char *id, const char *env, screen_output *outputs, const int max) {
+    wl_session *s = get_session(id, env);
+    if (s == NULL) {
+        return WRONG_PLUGIN;
+    }
+
+    int ret = check_session(s);
+    if (ret == 0) {
+        for (int i = 0; i < WL_MAX_OUTPUTS; i++) {
+            if (s->outputs[i].output) {
+                start_capture(s, &s->outputs[i], &s->outputs[i].cap);
+            }
+        }
+
+        int r = 0;
+        while (capture_pending(s) && (r = wl_display_dispatch(s->dpy)) != -1) {
+            // This space is intentionally left blank
+        }
+
+        for (int i = 0; i < WL_MAX_OUTPUTS; i++) {
+            wl_out *o = &s->outputs[i];
+            /* Outputs may have been removed in the meantime */
+            if (o->output && o->cap.frame) {
+                const int br = end_capture(&o->cap);
+                if (ret < max) {
+                    snprintf(outputs[ret].name, sizeof(outputs[ret].name), "%s", o->name);
+                    outputs[ret].br = br;
+                    ret++;
+                }
+            }
+        }
+
+        if (r == -1) {
+            map_remove(sessions, id);
+        }
+    }
+    return ret;
+}
+
+/*
+ * Watch first output: a copy_with_damage request is kept pending,
+ * so that compositor only sends a frame once something changed.
+ * Until then, brightness is computed from cached tiles, without waiting for it.
+ */
+static int watch_frame_brightness(const char *id, const char *env) {
+    wl_session *s = get_session(id, env);
+    if (s == NULL) {
+        return WRONG_PLUGIN;
+    }
+
+    int ret = check_session(s);
+    if (ret == 0) {
+        wl_out *o = NULL;
+        for (int i = 0; i < WL_MAX_OUTPUTS && !o; i++) {
+            if (s->outputs[i].output) {
+                o = &s->outputs[i];
+            }
+        }
+
+        int r = 0;
+        if (!o->watch.frame) {
+            /* First frame is a plain copy: wait for it */
+            start_capture(s, o, &o->watch);
+            while (!o->watch.buffer_copy_done && !o->watch.buffer_copy_err &&
+                   (r = wl_display_dispatch(s->dpy)) != -1) {
+                // This space is intentionally left blank
+            }
+        } else {
+            r = dispatch_nonblock(s->dpy);
+        }
+
+        if (o->watch.buffer_copy_done || o->watch.buffer_copy_err) {
+            ret = update_watch(o);
+            if (r != -1) {
+                /* Request next frame right away */
+                start_capture(s, o, &o->watch);
+                wl_display_flush(s->dpy);
+            }
+        } else {
+            ret = frame_tiles_brightness(&o->tiles);
+        }
+
+        if (r == -1) {
+            map_remove(sessions, id);
+        }
+    }
+    return ret;
+}
+
+static wl_session *get_session(const char *id, const char *env) {
     struct wl_display *display = fetch_wl_display(id, env);
     if (display == NULL) {
-        return WRONG_PLUGIN;
+        return NULL;
+    }
+
+    if (!sessions) {
+        sessions = map_new(true, session_dtor);
     }
-    
-    int ret = UNSUPPORTED;
 
-    registry = wl_display_get_registry(display);
-    wl_registry_add_listener(registry, &registry_listener, NULL);
-    
-    wl_display_dispatch(display);
-    wl_display_roundtrip(display);
-    
-    if (screencopy_manager == NULL) {
-        ret = COMPOSITOR_NO_PROTOCOL;
-        goto err;
+    wl_session *s = map_get(sessions, id);
+    if (s && s->dpy != display) {
+        map_remove(sessions, id);
+        s = NULL;
     }
-    if (shm == NULL) {
+
+    if (!s) {
+        s = calloc(1, sizeof(wl_session));
+        if (!s) {
+            return NULL;
+        }
+        s->dpy = display;
+        s->registry = wl_display_get_registry(display);
+        wl_registry_add_listener(s->registry, &registry_listener, s);
+
+        /* First roundtrip binds globals, second one receives output events */
+        wl_display_roundtrip(display);
+        wl_display_roundtrip(display);
+        map_put(sessions, id, s);
+    } else {
+        /* Handle any already received event, eg: outputs hotplug */
+        wl_display_dispatch_pending(display);
+    }
+    return s;
+}
+
+static int check_session(wl_session *s) {
+    if (s->screencopy_manager == NULL) {
+        return COMPOSITOR_NO_PROTOCOL;
+    }
+    if (s->shm == NULL) {
         fprintf(stderr, "compositor is missing wl_shm\n");
-        ret = COMPOSITOR_NO_PROTOCOL;
-        goto err;
-    }
-    if (output == NULL) {
-        fprintf(stderr, "no outputs available\n");
-        goto err;
-    }
-    
-    frame = zwlr_screencopy_manager_v1_capture_output(screencopy_manager, 0, output);
-    zwlr_screencopy_frame_v1_add_listener(frame, &frame_listener, NULL);
-    
-    while (!buffer_copy_done && !buffer_copy_err && wl_display_dispatch(display) != -1) {
-        // This space is intentionally left blank
-    }
-    
-    ret = -EIO;
-    if (buffer_copy_done) {
-        ret = rgb_frame_brightness(buffer.data, buffer.width, buffer.height, buffer.stride);
-    }
-    
-err:
-    dtor();
+        return COMPOSITOR_NO_PROTOCOL;
+    }
+    for (int i = 0; i < WL_MAX_OUTPUTS; i++) {
+        if (s->outputs[i].output) {
+            return 0;
+        }
+    }
+    fprintf(stderr, "no outputs available\n");
+    return UNSUPPORTED;
+}
+
+static void start_capture(wl_session *s, wl_out *o, wl_capture *cap) {
+    /*
+     * Unless a region was requested (and it lies within output),
+     * only capture central region of output, like Xorg plugin does.
+     * Note that screencopy offers no scaling: compositor will always copy it at full resolution.
+     */
+    int w = o->width, h = o->height;
+    if (o->transform % 2) {
+        /* Rotated by 90 or 270 degrees */
+        w = o->height;
+        h = o->width;
+    }
+    w /= o->scale;
+    h /= o->scale;
+    screen_roi area;
+    const screen_roi *roi = cap == &o->cap ? screen_get_roi() : NULL;
+    if (roi && w > 0 && h > 0 && screen_clip_roi(roi, w, h, &area) == 0) {
+        cap->frame = zwlr_screencopy_manager_v1_capture_output_region(s->screencopy_manager, 0, o->output,
+                                                                       area.x, area.y, area.w, area.h);
+    } else if (w > 0 && h > 0) {
+        const int cw = WL_FRAME_PCT * w;
+        const int ch = WL_FRAME_PCT * h;
+        cap->frame = zwlr_screencopy_manager_v1_capture_output_region(s->screencopy_manager, 0, o->output,
+                                                                       (w - cw) / 2, (h - ch) / 2, cw, ch);
+    } else {
+        cap->frame = zwlr_screencopy_manager_v1_capture_output(s->screencopy_manager, 0, o->output);
+    }
+    cap->out = o;
+    /* Only wait for damage once we have something to compare to */
+    cap->with_damage = cap == &o->watch && o->tiles.width;
+    zwlr_screencopy_frame_v1_add_listener(cap->frame, &frame_listener, cap);
+}
+
+static bool capture_pending(wl_session *s) {
+    for (int i = 0; i < WL_MAX_OUTPUTS; i++) {
+        const wl_capture *cap = &s->outputs[i].cap;
+        if (cap->frame && !cap->buffer_copy_done && !cap->buffer_copy_err) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static int end_capture(wl_capture *cap) {
+    int ret = -EIO;
+    if (cap->buffer_copy_done) {
+        const shm_buffer *buf = cap->buffer;
+        const int fmt = get_frame_format(buf->format);
+        if (fmt >= 0) {
+            ret = rgb_frame_brightness(buf->data, buf->width, buf->height, buf->stride, fmt);
+            /*
+             * Requested region is in output coordinates, and brightness does not depend on rows order:
+             * only exported frame needs to be turned back upside up.
+             */
+            if (cap->y_invert) {
+                screen_flip_export();
+            }
+        } else {
+            fprintf(stderr, "unsupported wl_shm format %d\n", buf->format);
+            ret = UNSUPPORTED;
+        }
+    }
+
+    if (cap->frame) {
+        zwlr_screencopy_frame_v1_destroy(cap->frame);
+    }
+    memset(cap, 0, sizeof(wl_capture));
+    return ret;
+}
+
+/* Recompute tiles damaged by a completed watch frame, then release it */
+static int update_watch(wl_out *o) {
+    wl_capture *cap = &o->watch;
+    int ret = -EIO;
+    if (cap->buffer_copy_done) {
+        const shm_buffer *buf = cap->buffer;
+        const int fmt = get_frame_format(buf->format);
+        if (fmt < 0) {
+            fprintf(stderr, "unsupported wl_shm format %d\n", buf->format);
+            ret = UNSUPPORTED;
+        } else if (!cap->with_damage || cap->full_damage) {
+            ret = rgb_frame_damage(&o->tiles, buf->data, buf->width, buf->height, buf->stride, fmt,
+                                   0, 0, buf->width, buf->height);
+        } else {
+            ret = 0;
+            for (int i = 0; i < cap->num_damage && ret == 0; i++) {
+                ret = rgb_frame_damage(&o->tiles, buf->data, buf->width, buf->height, buf->stride, fmt,
+                                       cap->damage[i].x, cap->damage[i].y, cap->damage[i].w, cap->damage[i].h);
+            }
+        }
+        if (ret == 0) {
+            ret = frame_tiles_brightness(&o->tiles);
+        }
+    }
+    if (ret < 0) {
+        /* Start from scratch with next frame */
+        frame_tiles_free(&o->tiles);
+    }
+
+    if (cap->frame) {
+        zwlr_screencopy_frame_v1_destroy(cap->frame);
+    }
+    memset(cap, 0, sizeof(wl_capture));
     return ret;
 }
 
-static struct wl_buffer *create_shm_buffer(enum wl_shm_format fmt,
-        int width, int height, int stride, void **data_out) {
-    
+/* Dispatch any event already sent by compositor, without blocking */
+static int dispatch_nonblock(struct wl_display *dpy) {
+    while (wl_display_prepare_read(dpy) != 0) {
+        if (wl_display_dispatch_pending(dpy) == -1) {
+            return -1;
+        }
+    }
+    wl_display_flush(dpy);
+
+    struct pollfd p = { .fd = wl_display_get_fd(dpy), .events = POLLIN };
+    if (poll(&p, 1, 0) == 1) {
+        if (wl_display_read_events(dpy) == -1) {
+            return -1;
+        }
+    } else {
+        wl_display_cancel_read(dpy);
+    }
+    return wl_display_dispatch_pending(dpy);
+}
+
+static void destroy_output(wl_out *o) {
+    end_capture(&o->cap);
+    end_capture(&o->watch);
+    for (int i = 0; i < WL_POOL_SIZE; i++) {
+        destroy_shm_buffer(&o->pool[i]);
+    }
+    destroy_shm_buffer(&o->watch_buf);
+    frame_tiles_free(&o->tiles);
+    if (o->output) {
+        release_output(o->output);
+    }
+    memset(o, 0, sizeof(wl_out));
+}
+
+/* wl_output.release (since version 3) lets compositor free its own resources too */
+static void release_output(struct wl_output *output) {
+#ifdef WL_OUTPUT_RELEASE_SINCE_VERSION
+    if (wl_output_get_version(output) >= WL_OUTPUT_RELEASE_SINCE_VERSION) {
+        wl_output_release(output);
+        return;
+    }
+#endif
+    wl_output_destroy(output);
+}
+
+static shm_buffer *get_shm_buffer(wl_out *o, enum wl_shm_format fmt, int width, int height, int stride) {
+    for (int i = 0; i < WL_POOL_SIZE; i++) {
+        shm_buffer *buf = &o->pool[i];
+        if (buf->wl_buffer && buf->format == fmt && buf->width == width &&
+            buf->height == height && buf->stride == stride) {
+            return buf;
+        }
+    }
+
+    /* Not found: (re)use next slot */
+    shm_buffer *buf = &o->pool[o->pool_next];
+    o->pool_next = (o->pool_next + 1) % WL_POOL_SIZE;
+    destroy_shm_buffer(buf);
+    if (create_shm_buffer(o->shm, buf, fmt, width, height, stride) == 0) {
+        return buf;
+    }
+    return NULL;
+}
+
+static int create_shm_buffer(struct wl_shm *shm, shm_buffer *buf, enum wl_shm_format fmt,
+        int width, int height, int stride) {
+
     const int size = stride * height;
 
     int fd = create_anonymous_file(size, "clightd-screen-wlr");
     if (fd < 0) {
         fprintf(stderr, "creating a buffer file for %d B failed: %m\n", size);
-        return NULL;
+        return -1;
     }
 
     void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
     if (data == MAP_FAILED) {
         fprintf(stderr, "mmap failed: %m\n");
         close(fd);
-        return NULL;
+        return -1;
     }
 
     struct wl_shm_pool *pool = wl_shm_create_pool(shm, fd, size);
     close(fd);
-    struct wl_buffer *buffer = wl_shm_pool_create_buffer(pool, 0, width, height,
-        stride, fmt);
+    buf->wl_buffer = wl_shm_pool_create_buffer(pool, 0, width, height, stride, fmt);
     wl_shm_pool_destroy(pool);
 
-    *data_out = data;
-    return buffer;
+    buf->data = data;
+    buf->format = fmt;
+    buf->width = width;
+    buf->height = height;
+    buf->stride = stride;
+    return 0;
+}
+
+static void destroy_shm_buffer(shm_buffer *buf) {
+    if (buf->wl_buffer) {
+        wl_buffer_destroy(buf->wl_buffer);
+        buf->wl_buffer = NULL;
+    }
+    if (buf->data) {
+        munmap(buf->data, buf->height * buf->stride);
+        buf->data = NULL;
+    }
 }
 
-static void frame_handle_buffer(void *tt, struct zwlr_screencopy_frame_v1 *frame, uint32_t format,
+static int get_frame_format(enum wl_shm_format format) {
+    switch (format) {
+    case WL_SHM_FORMAT_ARGB8888:
+    case WL_SHM_FORMAT_XRGB8888:
+        return FRAME_XRGB8888;
+    case WL_SHM_FORMAT_ABGR8888:
+    case WL_SHM_FORMAT_XBGR8888:
+        return FRAME_XBGR8888;
+    case WL_SHM_FORMAT_ARGB2101010:
+    case WL_SHM_FORMAT_XRGB2101010:
+        return FRAME_XRGB2101010;
+    case WL_SHM_FORMAT_RGB888:
+        return FRAME_RGB888;
+    case WL_SHM_FORMAT_RGB565:
+        return FRAME_RGB565;
+    default:
+        return -1;
+    }
+}
+
+static void frame_handle_buffer(void *data, struct zwlr_screencopy_frame_v1 *frame, uint32_t format,
     uint32_t width, uint32_t height, uint32_t stride) {
 
-    buffer.format = format;
-    buffer.width = width;
-    buffer.height = height;
-    buffer.stride = stride;
-    buffer.wl_buffer = create_shm_buffer(format, width, height, stride, &buffer.data);
-    if (buffer.wl_buffer == NULL) {
+    wl_capture *cap = (wl_capture *)data;
+    wl_out *o = cap->out;
+    if (cap == &o->watch) {
+        /* Watched frames always go to the same buffer, so that we know what undamaged tiles contain */
+        shm_buffer *buf = &o->watch_buf;
+        if (!buf->wl_buffer || buf->format != format || buf->width != (int)width ||
+            buf->height != (int)height || buf->stride != (int)stride) {
+
+            destroy_shm_buffer(buf);
+            cap->full_damage = true;
+            if (create_shm_buffer(o->shm, buf, format, width, height, stride) == 0) {
+                cap->buffer = buf;
+            }
+        } else {
+            cap->buffer = buf;
+        }
+    } else {
+        cap->buffer = get_shm_buffer(o, format, width, height, stride);
+    }
+
+    if (cap->buffer == NULL) {
         fprintf(stderr, "failed to create buffer\n");
-        buffer_copy_err = true;
+        cap->buffer_copy_err = true;
+    } else if (cap->with_damage) {
+        zwlr_screencopy_frame_v1_copy_with_damage(frame, cap->buffer->wl_buffer);
     } else {
-        zwlr_screencopy_frame_v1_copy(frame, buffer.wl_buffer);
+        zwlr_screencopy_frame_v1_copy(frame, cap->buffer->wl_buffer);
     }
 }
 
-static void frame_handle_flags(void*tt, struct zwlr_screencopy_frame_v1 *frame, uint32_t flags) {
-    buffer.y_invert = flags & ZWLR_SCREENCOPY_FRAME_V1_FLAGS_Y_INVERT;
+static void frame_handle_flags(void *data, struct zwlr_screencopy_frame_v1 *frame, uint32_t flags) {
+    wl_capture *cap = (wl_capture *)data;
+    cap->y_invert = flags & ZWLR_SCREENCOPY_FRAME_V1_FLAGS_Y_INVERT;
 }
 
-static void frame_handle_ready(void *tt, struct zwlr_screencopy_frame_v1 *frame,
+static void frame_handle_ready(void *data, struct zwlr_screencopy_frame_v1 *frame,
     uint32_t tv_sec_hi, uint32_t tv_sec_low, uint32_t tv_nsec) {
-    buffer_copy_done = true;
+    wl_capture *cap = (wl_capture *)data;
+    cap->buffer_copy_done = true;
 }
 
-static void frame_handle_failed(void *tt, struct zwlr_screencopy_frame_v1 *frame) {
+static void frame_handle_failed(void *data, struct zwlr_screencopy_frame_v1 *frame) {
+    wl_capture *cap = (wl_capture *)data;
     fprintf(stderr, "failed to copy frame\n");
-    buffer_copy_err = true;
+    cap->buffer_copy_err = true;
+}
+
+/* Damage is in buffer coordinates, sent before ready event */
+static void frame_handle_damage(void *data, struct zwlr_screencopy_frame_v1 *frame,
+    uint32_t x, uint32_t y, uint32_t width, uint32_t height) {
+    wl_capture *cap = (wl_capture *)data;
+    if (cap->num_damage < WL_MAX_DAMAGE) {
+        cap->damage[cap->num_damage].x = x;
+        cap->damage[cap->num_damage].y = y;
+        cap->damage[cap->num_damage].w = width;
+        cap->damage[cap->num_damage].h = height;
+        cap->num_damage++;
+    } else {
+        cap->full_damage = true;
+    }
 }
 
 static void handle_global(void *data, struct wl_registry *registry,
         uint32_t name, const char *interface, uint32_t version) {
 
-    // we just use first output
-    if (strcmp(interface, wl_output_interface.name) == 0 && !output) {
-        output = wl_registry_bind(registry, name, &wl_output_interface, 1);
+    wl_session *s = (wl_session *)data;
+    if (strcmp(interface, wl_output_interface.name) == 0) {
+        for (int i = 0; i < WL_MAX_OUTPUTS; i++) {
+            wl_out *o = &s->outputs[i];
+            if (!o->output) {
+                o->output = wl_registry_bind(registry, name, &wl_output_interface,
+                                             version < WL_OUTPUT_VERSION ? version : WL_OUTPUT_VERSION);
+                o->global_name = name;
+                o->shm = s->shm;
+                o->scale = 1;
+                snprintf(o->name, sizeof(o->name), "output-%u", name);
+                wl_output_add_listener(o->output, &output_listener, o);
+                break;
+            }
+        }
     }
-    else if (strcmp(interface, wl_shm_interface.name) == 0) {
-        shm = wl_registry_bind(registry, name, &wl_shm_interface, 1);
+    else if (strcmp(interface, wl_shm_interface.name) == 0 && !s->shm) {
+        s->shm = wl_registry_bind(registry, name, &wl_shm_interface, 1);
+        /* Outputs may have been advertised before wl_shm */
+        for (int i = 0; i < WL_MAX_OUTPUTS; i++) {
+            s->outputs[i].shm = s->shm;
+        }
     }
-    else if (strcmp(interface, zwlr_screencopy_manager_v1_interface.name) == 0) {
-        screencopy_manager = wl_registry_bind(registry, name, &zwlr_screencopy_manager_v1_interface, 2);
+    else if (strcmp(interface, zwlr_screencopy_manager_v1_interface.name) == 0 && !s->screencopy_manager) {
+        s->screencopy_manager = wl_registry_bind(registry, name, &zwlr_screencopy_manager_v1_interface, 2);
     }
 }
 
 static void handle_global_remove(void *data, struct wl_registry *registry, uint32_t name) {
-    
+    wl_session *s = (wl_session *)data;
+    for (int i = 0; i < WL_MAX_OUTPUTS; i++) {
+        wl_out *o = &s->outputs[i];
+        if (o->output && name == o->global_name) {
+            destroy_output(o);
+            break;
+        }
+    }
 }
 
-static void dtor(void) {
-    buffer_copy_done = false;
-    buffer_copy_err = false;
-    
-    /* Free everything */
-    if (buffer.wl_buffer) {
-        wl_buffer_destroy(buffer.wl_buffer);
-        buffer.wl_buffer = NULL;
+static void output_handle_geometry(void *data, struct wl_output *wl_output, int32_t x, int32_t y,
+        int32_t phys_w, int32_t phys_h, int32_t subpixel, const char *make, const char *model, int32_t transform) {
+    wl_out *o = (wl_out *)data;
+    o->transform = transform;
+    if (!o->has_name) {
+        snprintf(o->name, sizeof(o->name), "%s %s", make, model);
     }
-    if (buffer.data) {
-        munmap(buffer.data, buffer.height * buffer.stride);
-        buffer.data = NULL;
-    }
-    if (output) {
-        wl_output_destroy(output);
-        output = NULL;
+}
+
+static void output_handle_mode(void *data, struct wl_output *wl_output, uint32_t flags,
+        int32_t width, int32_t height, int32_t refresh) {
+    wl_out *o = (wl_out *)data;
+    if (flags & WL_OUTPUT_MODE_CURRENT) {
+        o->width = width;
+        o->height = height;
     }
-     if (registry) {
-        wl_registry_destroy(registry);
+}
+
+static void output_handle_done(void *data, struct wl_output *wl_output) {
+
+}
+
+static void output_handle_scale(void *data, struct wl_output *wl_output, int32_t factor) {
+    wl_out *o = (wl_out *)data;
+    o->scale = factor > 0 ? factor : 1;
+}
+
+#ifdef WL_OUTPUT_NAME_SINCE_VERSION
+static void output_handle_name(void *data, struct wl_output *wl_output, const char *name) {
+    wl_out *o = (wl_out *)data;
+    snprintf(o->name, sizeof(o->name), "%s", name);
+    o->has_name = true;
+}
+
+static void output_handle_description(void *data, struct wl_output *wl_output, const char *description) {
+
+}
+#endif
+
+static void session_dtor(void *data) {
+    wl_session *s = (wl_session *)data;
+
+    /* Free everything */
+    for (int i = 0; i < WL_MAX_OUTPUTS; i++) {
+        destroy_output(&s->outputs[i]);
     }
-    if (frame) {
-        zwlr_screencopy_frame_v1_destroy(frame);
+    if (s->shm) {
+        wl_shm_destroy(s->shm);
     }
-    if (shm) {
-        wl_shm_destroy(shm);
+    if (s->screencopy_manager) {
+        zwlr_screencopy_manager_v1_destroy(s->screencopy_manager);
     }
-    if (screencopy_manager) {
-        zwlr_screencopy_manager_v1_destroy(screencopy_manager);
+    if (s->registry) {
+        wl_registry_destroy(s->registry);
     }
-     // NOTE: dpy is disconnected on program exit to workaround
+    free(s);
+    // NOTE: dpy is disconnected on program exit to workaround
     // gamma protocol limitation that resets gamma as soon as display is disconnected.
     // See wl_utils.c
 }
@@ -1,38 +1,525 @@
 #include "screen.h"
 #include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
+#include <X11/extensions/Xrender.h>
+#include <X11/extensions/Xdamage.h>
+#include <sys/shm.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <module/map.h>
 
-static int getRootBrightness(const char *screen_name);
+/* window frame size definition: 85% should be ok */
+#define XORG_FRAME_PCT      0.85
+#define XORG_SCALED_W       128     // width of server side downscaled frame
+#define XORG_MAX_SESSIONS   8       // least recently used session is dropped to make room for a new one
 
-SCREEN("Xorg");
+/*
+ * A connection is kept open for each display and xauthority pair,
+ * together with a shared memory XImage that gets reused between calls
+ * and only reallocated when root window size changes (eg: on RandR changes).
+ * When XRender is available, captured area is downscaled by X server
+ * into a small pixmap, and only that one gets transferred.
+ * When watched, XDamage is used to skip capturing a static screen,
+ * and to only recompute damaged tiles otherwise.
+ */
+typedef struct {
+    Display *dpy;
+    Window root;
+    int width;                  // root window size
+    int height;
+    int x;                      // captured area
+    int y;
+    int w;
+    int h;
+    bool use_shm;
+    XShmSegmentInfo shminfo;
+    XImage *ximage;             // shm image, if use_shm
+    bool use_render;
+    Pixmap pixmap;              // downscaled frame, if use_render
+    Picture src;
+    Picture dst;
+    Drawable drawable;          // where image is grabbed from: root window or pixmap
+    int img_x;                  // grabbed area
+    int img_y;
+    int img_w;
+    int img_h;
+    bool use_damage;
+    Damage damage;              // root window damage, created on first watch call
+    XserverRegion region;       // damaged region fetched on each watch call
+    frame_tiles tiles;
+    bool dead;                  // X server went away
+    time_t last_used;           // CLOCK_MONOTONIC seconds
+} xorg_session;
+
+/* Least recently used session, found by find_lru */
+typedef struct {
+    char key[PATH_MAX + 1];
+    time_t last_used;
+} xorg_lru;
+
+static xorg_session *get_session(const char *screen_name, const char *env);
+static bool is_alive(xorg_session *s);
+static void handle_events(xorg_session *s);
+static int create_image(xorg_session *s);
+static void destroy_image(xorg_session *s);
+static int create_render(xorg_session *s);
+static void destroy_render(xorg_session *s);
+static int error_handler(Display *dpy, XErrorEvent *ev);
+static void io_error_exit_handler(Display *dpy, void *userdata);
+static int getRootBrightness(xorg_session *s);
+static XImage *grab_image(xorg_session *s);
+static XImage *grab_region(xorg_session *s, const screen_roi *roi);
+static void release_image(xorg_session *s, XImage *ximage);
+static int update_damaged_tiles(xorg_session *s, const XImage *ximage, const int fmt,
+                                const XRectangle *rects, const int num_rects);
+static int get_frame_format(const XImage *ximage);
+static void session_dtor(void *data);
+static map_ret_code find_idle(void *userdata, const char *key, void *data);
+static map_ret_code find_lru(void *userdata, const char *key, void *data);
+static time_t now_s(void);
+
+static int watch_frame_brightness(const char *id, const char *env);
+static void release_idle_sessions(void);
+
+SCREEN_EXT("Xorg", .watch = watch_frame_brightness, .release_idle = release_idle_sessions);
+
+static map_t *sessions;
+static bool x_error;
+
+static void _dtor_ destroy_sessions(void) {
+    map_free(sessions);
+}
 
 static int get_frame_brightness(const char *id, const char *env) {
-    setenv("XAUTHORITY", env, 1);
-    const int br = getRootBrightness(id);
-    unsetenv("XAUTHORITY");
-    return br;
+    xorg_session *s = get_session(id, env);
+    if (!s) {
+        return WRONG_PLUGIN;
+    }
+    return getRootBrightness(s);
 }
 
-/* Robbed from calise source code, thanks!! */
-static int getRootBrightness(const char *screen_name) {
-    Display *dpy = XOpenDisplay(screen_name);
-    if (!dpy) {
+static int watch_frame_brightness(const char *id, const char *env) {
+    xorg_session *s = get_session(id, env);
+    if (!s) {
         return WRONG_PLUGIN;
     }
+    if (!s->use_damage) {
+        return getRootBrightness(s);
+    }
     
-    int ret = UNSUPPORTED;
-    /* window frame size definition: 85% should be ok */
-    const float pct = 0.85;
-    int w = (int) (pct * XDisplayWidth(dpy, 0));
-    int h = (int) (pct * XDisplayHeight(dpy, 0));
-    int x = (XDisplayWidth(dpy, 0) - w) / 2;
-    int y = (XDisplayHeight(dpy, 0) - h) / 2;
+    handle_events(s);
+    if (!s->damage) {
+        s->damage = XDamageCreate(s->dpy, s->root, XDamageReportNonEmpty);
+        s->region = XFixesCreateRegion(s->dpy, NULL, 0);
+    }
+    
+    /* Move accumulated damage to our region, resetting it */
+    XDamageSubtract(s->dpy, s->damage, None, s->region);
+    int num_rects = 0;
+    XRectangle *rects = XFixesFetchRegion(s->dpy, s->region, &num_rects);
     
-    Window root_window = XRootWindow(dpy, XDefaultScreen(dpy));
-    XImage *ximage = XGetImage(dpy, root_window, x, y, w, h, AllPlanes, ZPixmap);
+    int ret;
+    if (num_rects == 0 && s->tiles.width) {
+        /* Nothing changed */
+        ret = frame_tiles_brightness(&s->tiles);
+    } else {
+        ret = UNSUPPORTED;
+        XImage *ximage = grab_image(s);
+        if (ximage) {
+            const int fmt = get_frame_format(ximage);
+            if (fmt >= 0) {
+                ret = update_damaged_tiles(s, ximage, fmt, rects, num_rects);
+            }
+            release_image(s, ximage);
+        }
+    }
+    if (rects) {
+        XFree(rects);
+    }
+    return ret;
+}
+
+static xorg_session *get_session(const char *screen_name, const char *env) {
+    if (!sessions) {
+        sessions = map_new(true, session_dtor);
+    }
+
+    /* Same display may be reached with different credentials */
+    char key[PATH_MAX + 1];
+    snprintf(key, sizeof(key), "%s %s", screen_name ? screen_name : "", env ? env : "");
+    xorg_session *s = map_get(sessions, key);
+    if (s && !is_alive(s)) {
+        /* Drop stale connection and try to reconnect */
+        s->dead = true;
+        map_remove(sessions, key);
+        s = NULL;
+    }
+
+    if (!s && map_length(sessions) >= XORG_MAX_SESSIONS) {
+        /* Make room for new session */
+        xorg_lru lru = { .last_used = -1 };
+        map_iterate(sessions, find_lru, &lru);
+        map_remove(sessions, lru.key);
+    }
+
+    if (!s) {
+        setenv("XAUTHORITY", env, 1);
+        Display *dpy = XOpenDisplay(screen_name);
+        unsetenv("XAUTHORITY");
+        if (!dpy) {
+            return NULL;
+        }
+        XSetIOErrorExitHandler(dpy, io_error_exit_handler, NULL);
+
+        s = calloc(1, sizeof(xorg_session));
+        if (!s) {
+            XCloseDisplay(dpy);
+            return NULL;
+        }
+        s->dpy = dpy;
+        s->root = XRootWindow(dpy, XDefaultScreen(dpy));
+        s->width = XDisplayWidth(dpy, XDefaultScreen(dpy));
+        s->height = XDisplayHeight(dpy, XDefaultScreen(dpy));
+        s->use_shm = XShmQueryExtension(dpy);
+        int event_base, error_base;
+        s->use_render = XRenderQueryExtension(dpy, &event_base, &error_base);
+        s->use_damage = XDamageQueryExtension(dpy, &event_base, &error_base) &&
+                        XFixesQueryExtension(dpy, &event_base, &error_base);
+        /* Get notified about root window size changes */
+        XSelectInput(dpy, s->root, StructureNotifyMask);
+        create_image(s);
+        map_put(sessions, key, s);
+    }
+    s->last_used = now_s();
+    return s;
+}
+
+/* Release connections unused for SCREEN_IDLE_TIMEOUT, eg: only requested once */
+static void release_idle_sessions(void) {
+    char key[PATH_MAX + 1];
+    while (sessions && map_iterate(sessions, find_idle, key) == MAP_FULL) {
+        map_remove(sessions, key);
+    }
+}
+
+static map_ret_code find_idle(void *userdata, const char *key, void *data) {
+    xorg_session *s = (xorg_session *)data;
+    if (now_s() - s->last_used >= SCREEN_IDLE_TIMEOUT) {
+        /* Return its key through userdata */
+        snprintf(userdata, PATH_MAX + 1, "%s", key);
+        return MAP_FULL; // break iteration
+    }
+    return MAP_OK;
+}
+
+static map_ret_code find_lru(void *userdata, const char *key, void *data) {
+    xorg_lru *lru = (xorg_lru *)userdata;
+    xorg_session *s = (xorg_session *)data;
+    if (lru->last_used == -1 || s->last_used < lru->last_used) {
+        snprintf(lru->key, sizeof(lru->key), "%s", key);
+        lru->last_used = s->last_used;
+    }
+    return MAP_OK;
+}
+
+static time_t now_s(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec;
+}
+
+/*
+ * Xlib would exit() on a broken connection:
+ * check it ourselves before issuing any request.
+ */
+static bool is_alive(xorg_session *s) {
+    struct pollfd p = { .fd = ConnectionNumber(s->dpy), .events = POLLIN };
+    if (poll(&p, 1, 0) == 1) {
+        char c;
+        if (p.revents & (POLLHUP | POLLERR) || recv(p.fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) <= 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void handle_events(xorg_session *s) {
+    bool resized = false;
+    while (XPending(s->dpy)) {
+        XEvent ev;
+        XNextEvent(s->dpy, &ev);
+        if (ev.type == ConfigureNotify && ev.xconfigure.window == s->root &&
+            (ev.xconfigure.width != s->width || ev.xconfigure.height != s->height)) {
+
+            s->width = ev.xconfigure.width;
+            s->height = ev.xconfigure.height;
+            resized = true;
+        }
+    }
+
+    if (resized) {
+        frame_tiles_free(&s->tiles);
+        destroy_render(s);
+        destroy_image(s);
+        create_image(s);
+    }
+}
+
+static int create_image(xorg_session *s) {
+    s->w = (int) (XORG_FRAME_PCT * s->width);
+    s->h = (int) (XORG_FRAME_PCT * s->height);
+    s->x = (s->width - s->w) / 2;
+    s->y = (s->height - s->h) / 2;
+
+    s->drawable = s->root;
+    s->img_x = s->x;
+    s->img_y = s->y;
+    s->img_w = s->w;
+    s->img_h = s->h;
+    if (s->use_render) {
+        create_render(s);
+    }
+
+    if (!s->use_shm) {
+        return 0;
+    }
+
+    const int screen = XDefaultScreen(s->dpy);
+    s->ximage = XShmCreateImage(s->dpy, XDefaultVisual(s->dpy, screen), XDefaultDepth(s->dpy, screen),
+                                ZPixmap, NULL, &s->shminfo, s->img_w, s->img_h);
+    if (!s->ximage) {
+        goto err;
+    }
+
+    s->shminfo.shmid = shmget(IPC_PRIVATE, s->ximage->bytes_per_line * s->ximage->height, IPC_CREAT | 0600);
+    if (s->shminfo.shmid == -1) {
+        goto err;
+    }
+    s->shminfo.shmaddr = s->ximage->data = shmat(s->shminfo.shmid, NULL, 0);
+    /* Segment will be destroyed as soon as both we and X server detach from it */
+    shmctl(s->shminfo.shmid, IPC_RMID, NULL);
+    if (s->shminfo.shmaddr == (void *)-1) {
+        s->shminfo.shmaddr = NULL;
+        goto err;
+    }
+    s->shminfo.readOnly = False;
+
+    /* Attach fails on remote displays; default error handler would exit() */
+    x_error = false;
+    XErrorHandler old_handler = XSetErrorHandler(error_handler);
+    const Bool attached = XShmAttach(s->dpy, &s->shminfo);
+    XSync(s->dpy, False);
+    XSetErrorHandler(old_handler);
+    if (attached && !x_error) {
+        return 0;
+    }
+
+    shmdt(s->shminfo.shmaddr);
+    s->shminfo.shmaddr = NULL;
+
+err:
+    fprintf(stderr, "Failed to setup MIT-SHM. Falling back to XGetImage.\n");
+    if (s->ximage) {
+        XDestroyImage(s->ximage);
+        s->ximage = NULL;
+    }
+    s->use_shm = false;
+    return -1;
+}
+
+static void destroy_image(xorg_session *s) {
+    if (s->ximage) {
+        if (!s->dead) {
+            XShmDetach(s->dpy, &s->shminfo);
+        }
+        XDestroyImage(s->ximage);
+        shmdt(s->shminfo.shmaddr);
+        s->ximage = NULL;
+    }
+}
+
+/*
+ * Setup a scaling transform from captured area of root window to a XORG_SCALED_W wide pixmap.
+ * Bilinear filter is enough as we would sample a sparse grid of pixels anyway.
+ */
+static int create_render(xorg_session *s) {
+    const int screen = XDefaultScreen(s->dpy);
+    XRenderPictFormat *fmt = XRenderFindVisualFormat(s->dpy, XDefaultVisual(s->dpy, screen));
+    if (!fmt || s->w <= XORG_SCALED_W) {
+        return -1;
+    }
+
+    const int w = XORG_SCALED_W;
+    const int h = s->h * w / s->w > 0 ? s->h * w / s->w : 1;
+    s->pixmap = XCreatePixmap(s->dpy, s->root, w, h, XDefaultDepth(s->dpy, screen));
+
+    XRenderPictureAttributes pa = { .subwindow_mode = IncludeInferiors };
+    s->src = XRenderCreatePicture(s->dpy, s->root, fmt, CPSubwindowMode, &pa);
+    s->dst = XRenderCreatePicture(s->dpy, s->pixmap, fmt, 0, NULL);
+
+    /* Transform maps destination coordinates to source ones */
+    XTransform t = {{
+        { XDoubleToFixed((double)s->w / w), 0, XDoubleToFixed(s->x) },
+        { 0, XDoubleToFixed((double)s->h / h), XDoubleToFixed(s->y) },
+        { 0, 0, XDoubleToFixed(1) }
+    }};
+    XRenderSetPictureTransform(s->dpy, s->src, &t);
+    XRenderSetPictureFilter(s->dpy, s->src, FilterBilinear, NULL, 0);
+
+    s->drawable = s->pixmap;
+    s->img_x = 0;
+    s->img_y = 0;
+    s->img_w = w;
+    s->img_h = h;
+    return 0;
+}
+
+static void destroy_render(xorg_session *s) {
+    if (s->pixmap && !s->dead) {
+        XRenderFreePicture(s->dpy, s->src);
+        XRenderFreePicture(s->dpy, s->dst);
+        XFreePixmap(s->dpy, s->pixmap);
+    }
+    s->pixmap = None;
+}
+
+static int error_handler(Display *dpy, XErrorEvent *ev) {
+    x_error = true;
+    return 0;
+}
+
+/*
+ * Default one would exit(): by returning, Xlib just marks the connection as broken,
+ * so that XCloseDisplay can still free it.
+ */
+static void io_error_exit_handler(Display *dpy, void *userdata) {
+
+}
+
+/* Robbed from calise source code, thanks!! */
+static int getRootBrightness(xorg_session *s) {
+    handle_events(s);
+
+    int ret = UNSUPPORTED;
+    XImage *ximage;
+    const screen_roi *roi = screen_get_roi();
+    if (roi) {
+        screen_roi area;
+        if (screen_clip_roi(roi, s->width, s->height, &area) != 0) {
+            return -EINVAL;
+        }
+        ximage = grab_region(s, &area);
+    } else {
+        ximage = grab_image(s);
+    }
     if (ximage) {
-        ret = rgb_frame_brightness((const uint8_t *)ximage->data, ximage->width, ximage->height, ximage->width);
+        const int fmt = get_frame_format(ximage);
+        if (fmt >= 0) {
+            ret = rgb_frame_brightness((const uint8_t *)ximage->data, ximage->width, ximage->height, ximage->bytes_per_line, fmt);
+        }
+        release_image(s, ximage);
+    }
+    return ret;
+}
+
+static XImage *grab_image(xorg_session *s) {
+    XImage *ximage = NULL;
+    /* Captured area may be out of bounds if root window was resized in the meantime */
+    x_error = false;
+    XErrorHandler old_handler = XSetErrorHandler(error_handler);
+    if (s->pixmap) {
+        XRenderComposite(s->dpy, PictOpSrc, s->src, None, s->dst, 0, 0, 0, 0, 0, 0, s->img_w, s->img_h);
+    }
+    if (s->use_shm) {
+        if (XShmGetImage(s->dpy, s->drawable, s->ximage, s->img_x, s->img_y, AllPlanes) && !x_error) {
+            ximage = s->ximage;
+        }
+    } else {
+        ximage = XGetImage(s->dpy, s->drawable, s->img_x, s->img_y, s->img_w, s->img_h, AllPlanes, ZPixmap);
+    }
+    XSetErrorHandler(old_handler);
+    return ximage;
+}
+
+/* Only transfer requested rectangle of root window */
+static XImage *grab_region(xorg_session *s, const screen_roi *roi) {
+    x_error = false;
+    XErrorHandler old_handler = XSetErrorHandler(error_handler);
+    XImage *ximage = XGetImage(s->dpy, s->root, roi->x, roi->y, roi->w, roi->h, AllPlanes, ZPixmap);
+    XSync(s->dpy, False);
+    XSetErrorHandler(old_handler);
+    if (ximage && x_error) {
         XDestroyImage(ximage);
+        ximage = NULL;
+    }
+    return ximage;
+}
+
+static void release_image(xorg_session *s, XImage *ximage) {
+    if (ximage != s->ximage) {
+        XDestroyImage(ximage);
+    }
+}
+
+/*
+ * Map damaged root window rectangles to grabbed image coordinates
+ * (captured area may be downscaled) and recompute intersecting tiles.
+ * First call computes whole frame.
+ */
+static int update_damaged_tiles(xorg_session *s, const XImage *ximage, const int fmt,
+                                const XRectangle *rects, const int num_rects) {
+    const uint8_t *data = (const uint8_t *)ximage->data;
+    int ret = 0;
+    if (!s->tiles.width) {
+        ret = rgb_frame_damage(&s->tiles, data, ximage->width, ximage->height, ximage->bytes_per_line, fmt,
+                               0, 0, ximage->width, ximage->height);
+    } else {
+        for (int i = 0; i < num_rects && ret == 0; i++) {
+            /* Add a pixel of margin for bilinear filtering */
+            const int x0 = (long)(rects[i].x - s->x) * s->img_w / s->w - 1;
+            const int y0 = (long)(rects[i].y - s->y) * s->img_h / s->h - 1;
+            const int x1 = ((long)(rects[i].x + rects[i].width - s->x) * s->img_w + s->w - 1) / s->w + 1;
+            const int y1 = ((long)(rects[i].y + rects[i].height - s->y) * s->img_h + s->h - 1) / s->h + 1;
+            ret = rgb_frame_damage(&s->tiles, data, ximage->width, ximage->height, ximage->bytes_per_line, fmt,
+                                   x0, y0, x1 - x0, y1 - y0);
+        }
+    }
+    if (ret == 0) {
+        ret = frame_tiles_brightness(&s->tiles);
     }
-    XCloseDisplay(dpy);
     return ret;
 }
+
+static int get_frame_format(const XImage *ximage) {
+    if (ximage->byte_order != LSBFirst) {
+        /* We only deal with little endian packed pixels */
+        return -1;
+    }
+    switch (ximage->bits_per_pixel) {
+    case 32:
+        if (ximage->red_mask == 0x3FF00000) {
+            return FRAME_XRGB2101010;
+        }
+        return ximage->red_mask == 0xFF ? FRAME_XBGR8888 : FRAME_XRGB8888;
+    case 24:
+        return FRAME_RGB888;
+    case 16:
+        return FRAME_RGB565;
+    default:
+        return -1;
+    }
+}
+
+static void session_dtor(void *data) {
+    xorg_session *s = (xorg_session *)data;
+    if (s->damage && !s->dead) {
+        XDamageDestroy(s->dpy, s->damage);
+        XFixesDestroyRegion(s->dpy, s->region);
+    }
+    frame_tiles_free(&s->tiles);
+    destroy_render(s);
+    destroy_image(s);
+    /* On a broken connection, io_error_exit_handler prevents Xlib from exiting */
+    XCloseDisplay(s->dpy);
+    free(s);
+}
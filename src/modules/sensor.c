@@ -1,7 +1,43 @@
 #include <sensor.h>
 #include <polkit.h>
+#include <module/map.h>
+#include <math.h>
 
 #define SENSOR_MAX_CAPTURES    20
+#define FUSED_OUTLIER_DIST     0.2     // max distance from median of sources, when at least 3 sources are available
+#define FUSED_MIN_VAR          0.0001  // variance floor, to avoid single-sample sources to dominate weighted mean
+#define STABLE_MIN_CAPTURES    3       // min number of captures before checking whether estimate is stable
+#define TRIMMED_DEF_PARAM      0.1     // default fraction of samples trimmed on each side by trimmed mean
+#define EMA_DEF_PARAM          0.5     // default alpha for exponential moving average
+
+#define _AGGREGATIONS \
+    X(MEAN, "mean") \
+    X(MEDIAN, "median") \
+    X(TRIMMED, "trimmed") \
+    X(EMA, "ema") \
+    X(MIN, "min") \
+    X(MAX, "max")
+
+enum aggregations {
+#define X(name, str) name,
+    _AGGREGATIONS
+#undef X
+    AGGREGATION_NUM
+};
+
+typedef struct {
+    sensor_fd_cb cb;
+    void *userdata;
+} sensor_fd;
+
+typedef struct {
+    sensor_t *sensor;
+    void *dev;
+    char *settings;
+    int num_captures;
+    double pct[SENSOR_MAX_CAPTURES];
+    int ret;
+} fused_src;
 
 static bool is_sensor_available(sensor_t *sensor, const char *interface, 
                                 void **device);
@@ -9,15 +45,30 @@ static void *find_available_sensor(sensor_t *sensor, const char *interface, void
 static void sensor_receive_device(const sensor_t *sensor, void **dev);
 static int method_issensoravailable(sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
 static int method_capturesensor(sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
+static int method_capturefused(sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
+static int method_captureaggregated(sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
+static int method_capturehistogram(sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
 
 static sensor_t *sensors[SENSOR_NUM];
+static map_t *sensor_fds;
+static frame_export *export;    // Set while a CaptureHistogram call is running
 static const char object_path[] = "/org/clightd/clightd/Sensor";
 static const char bus_interface[] = "org.clightd.clightd.Sensor";
 static const sd_bus_vtable vtable[] = {
     SD_BUS_VTABLE_START(0),
     SD_BUS_METHOD("Capture", "sis", "sad", method_capturesensor, SD_BUS_VTABLE_UNPRIVILEGED),
+    SD_BUS_METHOD("CaptureAggregated", "sis(sdd)", "sdd", method_captureaggregated, SD_BUS_VTABLE_UNPRIVILEGED),
+    SD_BUS_METHOD("CaptureHistogram", "ssb", "sh", method_capturehistogram, SD_BUS_VTABLE_UNPRIVILEGED),
     SD_BUS_METHOD("IsAvailable", "s", "sb", method_issensoravailable, SD_BUS_VTABLE_UNPRIVILEGED),
     SD_BUS_SIGNAL("Changed", "ss", 0),
+    SD_BUS_SIGNAL("ValueChanged", "sd", 0),
+    SD_BUS_VTABLE_END
+};
+static const char fused_path[] = "/org/clightd/clightd/Sensor/Fused";
+static const char fused_interface[] = "org.clightd.clightd.Sensor.Fused";
+static const sd_bus_vtable fused_vtable[] = {
+    SD_BUS_VTABLE_START(0),
+    SD_BUS_METHOD("Capture", "ia{ss}", "da(sad)", method_capturefused, SD_BUS_VTABLE_UNPRIVILEGED),
     SD_BUS_VTABLE_END
 };
 
@@ -36,12 +87,19 @@ static bool evaluate(void) {
 }
 
 static void init(void) {
+    sensor_fds = map_new(true, free);
     int r = sd_bus_add_object_vtable(bus,
                                     NULL,
                                     object_path,
                                     bus_interface,
                                     vtable,
                                     NULL);
+    r += sd_bus_add_object_vtable(bus,
+                                  NULL,
+                                  fused_path,
+                                  fused_interface,
+                                  fused_vtable,
+                                  NULL);
     for (int i = 0; i < SENSOR_NUM && !r; i++) {
         if (sensors[i]) {
             snprintf(sensors[i]->obj_path, sizeof(sensors[i]->obj_path) - 1, "%s/%s", object_path, sensors[i]->name);
@@ -61,6 +119,15 @@ static void init(void) {
 
 static void receive(const msg_t *msg, const void *userdata) {
     if (!msg->is_pubsub) {
+        char key[16];
+        snprintf(key, sizeof(key), "%d", msg->fd_msg->fd);
+        sensor_fd *sfd = map_get(sensor_fds, key);
+        if (sfd) {
+            /* Fd registered by a sensor through sensor_register_fd() */
+            sfd->cb(msg->fd_msg->fd, sfd->userdata);
+            return;
+        }
+        
         sensor_t *sensor = (sensor_t *)msg->fd_msg->userptr;
         void *dev = NULL;
         sensor_receive_device(sensor, &dev);
@@ -83,6 +150,7 @@ static void destroy(void) {
             sensors[i]->destroy_monitor();
         }
     }
+    map_free(sensor_fds);
 }
 
 void sensor_register_new(sensor_t *sensor) {
@@ -107,6 +175,70 @@ void sensor_register_new(sensor_t *sensor) {
     }
 }
 
+/* Note: fd will be closed when deregistered */
+int sensor_register_fd(int fd, sensor_fd_cb cb, void *userdata) {
+    sensor_fd *sfd = malloc(sizeof(sensor_fd));
+    if (!sfd) {
+        return -ENOMEM;
+    }
+    
+    sfd->cb = cb;
+    sfd->userdata = userdata;
+    int r = m_register_fd(fd, true, sfd);
+    if (r == 0) {
+        char key[16];
+        snprintf(key, sizeof(key), "%d", fd);
+        map_put(sensor_fds, key, sfd);
+    } else {
+        free(sfd);
+    }
+    return r;
+}
+
+int sensor_deregister_fd(int fd) {
+    char key[16];
+    snprintf(key, sizeof(key), "%d", fd);
+    map_remove(sensor_fds, key);
+    return m_deregister_fd(fd);
+}
+
+void sensor_emit_value(const char *name, const char *node, const double pct) {
+    for (int i = 0; i < SENSOR_NUM; i++) {
+        if (sensors[i] && !strcmp(sensors[i]->name, name)) {
+            sd_bus_emit_signal(bus, sensors[i]->obj_path, bus_interface, "ValueChanged", "sd", node, pct);
+            /* ValueChanged is emitted on Sensor main object too */
+            sd_bus_emit_signal(bus, object_path, bus_interface, "ValueChanged", "sd", node, pct);
+            break;
+        }
+    }
+}
+
+/*
+ * Called by sensors after each capture: returns true if they can stop capturing,
+ * ie: if samples standard error is below tolerance (0 to disable).
+ */
+bool sensor_capture_is_stable(const double *pct, const int ctr, const double tolerance) {
+    if (tolerance <= 0.0 || ctr < STABLE_MIN_CAPTURES) {
+        return false;
+    }
+    
+    double mean = 0.0, var = 0.0;
+    for (int i = 0; i < ctr; i++) {
+        mean += pct[i];
+    }
+    mean /= ctr;
+    for (int i = 0; i < ctr; i++) {
+        var += pow(pct[i] - mean, 2);
+    }
+    var /= ctr;
+    return sqrt(var / ctr) < tolerance;
+}
+
+/* Called by frame based sensors: returns non-NULL if they should fill a frame export */
+frame_export *sensor_get_export(void) {
+    return export;
+}
+
 static void sensor_receive_device(const sensor_t *sensor, void **dev) {
     *dev = NULL;
     if (sensor) {
@@ -202,7 +334,7 @@ static int method_capturesensor(sd_bus_message *m, void *userdata, sd_bus_error
         r = -ENODEV;
         if (sensor) {
             /* Bus Interface required sensor-specific method */
-            r = sensor->capture(dev, pct, num_captures, settings);
+            r = sensor->capture(dev, pct, num_captures, 0.0, settings);
         }
     } else {
         r = -ENOMEM;
@@ -233,3 +365,353 @@ static int method_capturesensor(sd_bus_message *m, void *userdata, sd_bus_error
     free(pct);
     return r;
 }
+
+/*
+ * Capture a single frame and return its luminance histogram
+ * (and a downscaled greyscale frame, if requested) through a sealed memfd.
+ * Only frame based sensors, ie: Camera, support this.
+ */
+static int method_capturehistogram(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+    ASSERT_AUTH();
+    
+    const char *interface = NULL;
+    char *settings = NULL;
+    int with_frame;
+    int r = sd_bus_message_read(m, "ssb", &interface, &settings, &with_frame);
+    if (r < 0) {
+        m_log("Failed to parse parameters: %s\n", strerror(-r));
+        return r;
+    }
+    
+    void *dev = NULL;
+    double pct;
+    frame_export ex = { .with_frame = with_frame };
+    sensor_t *sensor = find_available_sensor(userdata, interface, &dev);
+    
+    r = -ENODEV;
+    if (sensor) {
+        export = &ex;
+        r = sensor->capture(dev, &pct, 1, 0.0, settings);
+        export = NULL;
+        if (r > 0 && !ex.filled) {
+            r = -EOPNOTSUPP;
+        }
+    }
+    
+    if (r > 0) {
+        int fd = frame_export_to_memfd(&ex);
+        if (fd >= 0) {
+            const char *node = NULL;
+            sensor->fetch_props_dev(dev, &node, NULL);
+            r = sd_bus_reply_method_return(m, "sh", node, fd);
+            close(fd); // sd-bus duplicates it
+        } else {
+            r = fd;
+        }
+    } else if (r == 0) {
+        r = -EIO;
+    }
+    
+    if (r < 0) {
+        sd_bus_error_set_errno(ret_error, -r);
+    }
+    
+    if (sensor) {
+        sensor->destroy_dev(dev);
+    }
+    free(ex.frame);
+    return r;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    const double x = *(const double *)a;
+    const double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double aggregate(double *pct, const int n, enum aggregations mode, double param) {
+    double val = 0.0;
+    switch (mode) {
+    case MEDIAN:
+        qsort(pct, n, sizeof(double), cmp_double);
+        val = n % 2 ? pct[n / 2] : (pct[n / 2 - 1] + pct[n / 2]) / 2;
+        break;
+    case TRIMMED: {
+        qsort(pct, n, sizeof(double), cmp_double);
+        const int trim = n * param;
+        for (int i = trim; i < n - trim; i++) {
+            val += pct[i];
+        }
+        val /= n - 2 * trim;
+        break;
+    }
+    case EMA:
+        val = pct[0];
+        for (int i = 1; i < n; i++) {
+            val = param * pct[i] + (1 - param) * val;
+        }
+        break;
+    case MIN:
+    case MAX:
+        val = pct[0];
+        for (int i = 1; i < n; i++) {
+            if ((mode == MIN && pct[i] < val) || (mode == MAX && pct[i] > val)) {
+                val = pct[i];
+            }
+        }
+        break;
+    default:
+        for (int i = 0; i < n; i++) {
+            val += pct[i];
+        }
+        val /= n;
+        break;
+    }
+    return val;
+}
+
+/*
+ * Capture and return a single aggregated value, plus samples variance.
+ * Param is trimmed fraction on each side for "trimmed" mode, and alpha for "ema" mode (0 for defaults).
+ * If tolerance is > 0, capture stops as soon as samples standard error gets below it.
+ */
+static int method_captureaggregated(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+    ASSERT_AUTH();
+    
+    const char *interface = NULL, *mode_str = NULL;
+    char *settings = NULL;
+    int num_captures;
+    double param, tolerance;
+    int r = sd_bus_message_read(m, "sis(sdd)", &interface, &num_captures, &settings, &mode_str, &param, &tolerance);
+    if (r < 0) {
+        m_log("Failed to parse parameters: %s\n", strerror(-r));
+        return r;
+    }
+    
+    if (num_captures <= 0 || num_captures > SENSOR_MAX_CAPTURES) {
+        sd_bus_error_set_const(ret_error, SD_BUS_ERROR_INVALID_ARGS, "Number of captures should be between 1 and 20.");
+        return -EINVAL;
+    }
+    
+    const char *modes[] = {
+    #define X(name, str) str,
+        _AGGREGATIONS
+    #undef X
+    };
+    enum aggregations mode;
+    for (mode = 0; mode < AGGREGATION_NUM && strcasecmp(modes[mode], mode_str); mode++);
+    if (mode == AGGREGATION_NUM) {
+        sd_bus_error_set_const(ret_error, SD_BUS_ERROR_INVALID_ARGS, "Aggregation mode should be one of mean, median, trimmed, ema, min, max.");
+        return -EINVAL;
+    }
+    
+    if (param == 0.0) {
+        param = mode == EMA ? EMA_DEF_PARAM : TRIMMED_DEF_PARAM;
+    }
+    if (!isfinite(param) || (mode == TRIMMED && (param < 0.0 || param >= 0.5)) || (mode == EMA && (param <= 0.0 || param > 1.0))) {
+        sd_bus_error_set_const(ret_error, SD_BUS_ERROR_INVALID_ARGS, "Wrong aggregation param value.");
+        return -EINVAL;
+    }
+    
+    if (!isfinite(tolerance) || tolerance < 0.0) {
+        sd_bus_error_set_const(ret_error, SD_BUS_ERROR_INVALID_ARGS, "Tolerance should be a non-negative number.");
+        return -EINVAL;
+    }
+    
+    void *dev = NULL;
+    double pct[SENSOR_MAX_CAPTURES];
+    sensor_t *sensor = find_available_sensor(userdata, interface, &dev);
+    r = -ENODEV;
+    if (sensor) {
+        r = sensor->capture(dev, pct, num_captures, tolerance, settings);
+    }
+    
+    if (r < 0) {
+        sd_bus_error_set_errno(ret_error, -r);
+    } else if (r == 0) {
+        sd_bus_error_set_errno(ret_error, EIO);
+    } else {
+        double mean = 0.0, var = 0.0;
+        for (int i = 0; i < r; i++) {
+            mean += pct[i];
+        }
+        mean /= r;
+        for (int i = 0; i < r; i++) {
+            var += pow(pct[i] - mean, 2);
+        }
+        var /= r;
+        
+        const char *node = NULL;
+        sensor->fetch_props_dev(dev, &node, NULL);
+        r = sd_bus_reply_method_return(m, "sdd", node, aggregate(pct, r, mode, param), var);
+    }
+    
+    if (sensor) {
+        sensor->destroy_dev(dev);
+    }
+    return r;
+}
+
+static int add_fused_src(fused_src *srcs, int *num_srcs, sensor_t *sensor, const char *settings, const int num_captures) {
+    /* Each sensor can only be used once, as sensors are not reentrant */
+    for (int i = 0; i < *num_srcs; i++) {
+        if (srcs[i].sensor == sensor) {
+            return -EINVAL;
+        }
+    }
+    
+    fused_src *src = &srcs[*num_srcs];
+    memset(src, 0, sizeof(fused_src));
+    if (!is_sensor_available(sensor, NULL, &src->dev)) {
+        return -ENODEV;
+    }
+    src->sensor = sensor;
+    src->settings = strdup(settings ? settings : "");
+    src->num_captures = num_captures;
+    (*num_srcs)++;
+    return 0;
+}
+
+/*
+ * Fused value is the inverse-variance weighted mean of each source's mean;
+ * when at least 3 sources are available, sources too far from the median are discarded first.
+ */
+static double fuse_srcs(const fused_src *srcs, const int num_srcs) {
+    double means[SENSOR_NUM], vars[SENSOR_NUM];
+    double sorted[SENSOR_NUM];
+    int n = 0;
+    for (int i = 0; i < num_srcs; i++) {
+        if (srcs[i].ret > 0) {
+            double mean = 0.0, var = 0.0;
+            for (int j = 0; j < srcs[i].ret; j++) {
+                mean += srcs[i].pct[j];
+            }
+            mean /= srcs[i].ret;
+            for (int j = 0; j < srcs[i].ret; j++) {
+                var += pow(srcs[i].pct[j] - mean, 2);
+            }
+            vars[n] = var / srcs[i].ret;
+            means[n] = mean;
+            
+            /* Insertion sort to find median */
+            int k = n++;
+            for (; k > 0 && sorted[k - 1] > mean; k--) {
+                sorted[k] = sorted[k - 1];
+            }
+            sorted[k] = mean;
+        }
+    }
+    
+    const double median = n % 2 ? sorted[n / 2] : (sorted[n / 2 - 1] + sorted[n / 2]) / 2;
+    double sum = 0.0, weights = 0.0;
+    for (int i = 0; i < n; i++) {
+        if (n < 3 || fabs(means[i] - median) <= FUSED_OUTLIER_DIST) {
+            const double w = 1.0 / (vars[i] + FUSED_MIN_VAR);
+            sum += w * means[i];
+            weights += w;
+        }
+    }
+    /* Every source is an outlier, eg: two far apart clusters: trust the median */
+    if (weights == 0.0) {
+        return median;
+    }
+    return sum / weights;
+}
+
+/*
+ * Capture from multiple sensors, one after the other, and return a fused value plus each source samples.
+ * Sensors are not thread safe (eg: they share udev context, and frame export),
+ * thus they cannot be captured concurrently.
+ * If no sensor is requested, all available sensors are used with default settings.
+ */
+static int method_capturefused(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+    ASSERT_AUTH();
+    
+    int num_captures;
+    int r = sd_bus_message_read(m, "i", &num_captures);
+    if (r < 0) {
+        m_log("Failed to parse parameters: %s\n", strerror(-r));
+        return r;
+    }
+    
+    if (num_captures <= 0 || num_captures > SENSOR_MAX_CAPTURES) {
+        sd_bus_error_set_const(ret_error, SD_BUS_ERROR_INVALID_ARGS, "Number of captures should be between 1 and 20.");
+        return -EINVAL;
+    }
+    
+    fused_src srcs[SENSOR_NUM];
+    int num_srcs = 0;
+    bool requested = false;
+    
+    r = sd_bus_message_enter_container(m, SD_BUS_TYPE_ARRAY, "{ss}");
+    while (r >= 0 && sd_bus_message_enter_container(m, SD_BUS_TYPE_DICT_ENTRY, "ss") > 0) {
+        const char *name = NULL, *settings = NULL;
+        r = sd_bus_message_read(m, "ss", &name, &settings);
+        if (r >= 0) {
+            requested = true;
+            r = -EINVAL;
+            for (int i = 0; i < SENSOR_NUM; i++) {
+                if (sensors[i] && !strcasecmp(sensors[i]->name, name)) {
+                    r = add_fused_src(srcs, &num_srcs, sensors[i], settings, num_captures);
+                    break;
+                }
+            }
+        }
+        sd_bus_message_exit_container(m);
+    }
+    if (r >= 0) {
+        sd_bus_message_exit_container(m);
+    }
+    
+    if (r >= 0 && !requested) {
+        for (int i = 0; i < SENSOR_NUM; i++) {
+            if (sensors[i]) {
+                add_fused_src(srcs, &num_srcs, sensors[i], NULL, num_captures);
+            }
+        }
+    }
+    
+    if (r >= 0 && num_srcs > 0) {
+        int captured = 0;
+        for (int i = 0; i < num_srcs; i++) {
+            srcs[i].ret = srcs[i].sensor->capture(srcs[i].dev, srcs[i].pct, srcs[i].num_captures, 0.0, srcs[i].settings);
+            if (srcs[i].ret > 0) {
+                captured++;
+            }
+        }
+        
+        if (captured > 0) {
+            sd_bus_message *reply = NULL;
+            sd_bus_message_new_method_return(m, &reply);
+            sd_bus_message_append(reply, "d", fuse_srcs(srcs, num_srcs));
+            sd_bus_message_open_container(reply, SD_BUS_TYPE_ARRAY, "(sad)");
+            for (int i = 0; i < num_srcs; i++) {
+                if (srcs[i].ret > 0) {
+                    const char *node = NULL;
+                    srcs[i].sensor->fetch_props_dev(srcs[i].dev, &node, NULL);
+                    sd_bus_message_open_container(reply, SD_BUS_TYPE_STRUCT, "sad");
+                    sd_bus_message_append(reply, "s", node);
+                    sd_bus_message_append_array(reply, 'd', srcs[i].pct, srcs[i].ret * sizeof(double));
+                    sd_bus_message_close_container(reply);
+                }
+            }
+            sd_bus_message_close_container(reply);
+            r = sd_bus_send(NULL, reply, NULL);
+            sd_bus_message_unref(reply);
+        } else {
+            r = -EIO;
+        }
+    } else if (r >= 0) {
+        r = -ENODEV;
+    }
+    
+    if (r < 0) {
+        sd_bus_error_set_errno(ret_error, -r);
+    }
+    
+    for (int i = 0; i < num_srcs; i++) {
+        srcs[i].sensor->destroy_dev(srcs[i].dev);
+        free(srcs[i].settings);
+    }
+    return r;
+}
@@ -14,13 +14,21 @@
  * -> recv_monitor() to retrieve a device from an awoken monitor fd
  * -> destroy_monitor() to free monitor resources
  * 
- * -> capture() that will actually capture frames from device
+ * -> capture() that will actually capture frames from device; 
+ *    it should stop early as soon as sensor_capture_is_stable() returns true for requested tolerance.
+ * 
+ * Sensors that need to poll their own fds (eg: Custom sensor streams) can hook them into
+ * Sensor module main loop through sensor_register_fd(), and remove them through sensor_deregister_fd().
+ * Sensors that get pushed new values can notify them through sensor_emit_value().
+ * Frame based sensors should fill the frame_export returned by sensor_get_export(), when non-NULL,
+ * with the histogram of captured frame.
  * 
  * To add a new sensor, just insert a new define in _SENSORS; note that sensors are priority-ordered: lower int has higher priority.
  * Remeber that sensor's name should contain sensor's define stringified to actually be registered.
  **/
 
 #include <commons.h>
+#include <frame_utils.h>
 
 /* Sensor->name must match its enumeration stringified value */
 #define _SENSORS \
@@ -45,7 +53,7 @@ typedef struct _sensor {
     int (*init_monitor)(void);
     void (*recv_monitor)(void **dev);
     void (*destroy_monitor)(void);  // return number of frames actually captured, or a -errno style error
-    int (*capture)(void *userdata, double *pct, const int num_captures, char *settings);
+    int (*capture)(void *userdata, double *pct, const int num_captures, const double tolerance, char *settings);
     char obj_path[100];
 } sensor_t;
 
@@ -57,10 +65,17 @@ typedef struct _sensor {
     static int init_monitor(void); \
     static void recv_monitor(void **dev); \
     static void destroy_monitor(void); \
-    static int capture(void *dev, double *pct, const int num_captures, char *settings); \
+    static int capture(void *dev, double *pct, const int num_captures, const double tolerance, char *settings); \
     static void _ctor_ register_sensor(void) { \
         static sensor_t self = { name, validate_dev, fetch_dev, fetch_props_dev, destroy_dev, init_monitor, recv_monitor, destroy_monitor, capture }; \
         sensor_register_new(&self); \
     }
 
+typedef void (*sensor_fd_cb)(int fd, void *userdata);
+
 void sensor_register_new(sensor_t *sensor);
+int sensor_register_fd(int fd, sensor_fd_cb cb, void *userdata);
+int sensor_deregister_fd(int fd);
+void sensor_emit_value(const char *name, const char *node, const double pct);
+bool sensor_capture_is_stable(const double *pct, const int ctr, const double tolerance);
+frame_export *sensor_get_export(void);
@@ -116,7 +116,7 @@ static void parse_settings(char *settings, int *min, int *max, int *interval) {
     }
 }
 
-static int capture(void *dev, double *pct, const int num_captures, char *settings) {
+static int capture(void *dev, double *pct, const int num_captures, const double tolerance, char *settings) {
     int min, max, interval;
     parse_settings(settings, &min, &max, &interval);
 
@@ -148,6 +148,9 @@ static int capture(void *dev, double *pct, const int num_captures, char *setting
 
         if (illuminance >= 0) {
             pct[ctr++] = illuminance / max;
+            if (sensor_capture_is_stable(pct, ctr, tolerance)) {
+                break;
+            }
         }
 
         usleep(interval * 1000);
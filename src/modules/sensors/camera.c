@@ -63,6 +63,8 @@ struct mjpeg_dec {
 struct state {
     int device_fd;
     uint32_t pixelformat;
+    int width;
+    int height;
     struct buffer buf;
     struct histogram hist[HISTOGRAM_STEPS];
     char *settings;
@@ -119,7 +121,7 @@ static void destroy_monitor(void) {
     udev_monitor_unref(mon);
 }
 
-static int capture(void *dev, double *pct, const int num_captures, char *settings) {
+static int capture(void *dev, double *pct, const int num_captures, const double tolerance, char *settings) {
     state.settings = settings;
     int ctr = 0;
     
@@ -132,6 +134,9 @@ static int capture(void *dev, double *pct, const int num_captures, char *setting
             
             if (send_frame(&buf) == 0 && recv_frame(&buf) == 0) {
                 pct[ctr++] = compute_brightness(buf.bytesused) / CAMERA_ILL_MAX;
+                if (sensor_capture_is_stable(pct, ctr, tolerance)) {
+                    break;
+                }
             }
         }
         destroy_decoder();
@@ -213,6 +218,9 @@ static int set_camera_fmt(void) {
         return -1;
     }
     
+    /* Driver may have adjusted requested resolution */
+    state.width = fmt.fmt.pix.width;
+    state.height = fmt.fmt.pix.height;
     INFO("Image fmt: %s\n", (char *)&fmt.fmt.pix.pixelformat);
     INFO("Image res: %d x %d\n", fmt.fmt.pix.width, fmt.fmt.pix.height);
     return 0;
@@ -296,6 +304,8 @@ static int mjpeg_to_gray(uint8_t **img_data, int size) {
     const int pixel_size = state.decoder->cinfo.output_components;
     const int row_stride = width * pixel_size;
     const int bmp_size = row_stride * height;
+    state.width = width;
+    state.height = height;
     
     *img_data = malloc(bmp_size);
     if (*img_data) {
@@ -420,6 +430,11 @@ static double compute_brightness(unsigned int size) {
      */
     const int inc = 1 + (state.pixelformat == V4L2_PIX_FMT_YUYV);
     const double total = size / inc;
+    
+    frame_export *ex = sensor_get_export();
+    if (ex && state.width * state.height * inc <= size) {
+        frame_export_luma(ex, img_data, state.width, state.height, inc);
+    }
 
     /* Find minimum and maximum brightness */
     for (int i = 0; i < size; i += inc) {
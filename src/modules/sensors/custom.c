@@ -1,19 +1,88 @@
+/**
+ * Custom sensor:
+ * 
+ * -> regular files are watched through inotify, and parsed once each time they are written
+ * -> sysfs and procfs files never notify any write: they are read num_captures times, interval ms apart, by capture()
+ * -> files outside sensors.d folder are read that same way, so that callers cannot make us watch (and signal) any file
+ * -> executables are started as long-lived coprocesses streaming newline-delimited values on their stdout
+ * -> fifos and unix sockets are read as streams of newline-delimited values too
+ * Only sources living in sensors.d folder can be streams: any other path is read as a plain file,
+ * as we would otherwise let any authorized caller run whatever executable as root.
+ * 
+ * Sources are started on first capture and then updated from sensor module main loop,
+ * keeping a ring of last received values: capture() just returns the ones received
+ * during last num_captures intervals or, when none was, the last one; as sources only
+ * push new values, it is still the current one.
+ * A "ValueChanged" signal is emitted whenever a new value lands.
+ * A stream that gets closed (eg: its coprocess died) is restarted on next capture.
+ **/
+
 #include <sensor.h>
 #include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <sys/signalfd.h>
+#include <sys/vfs.h>
+#include <linux/magic.h>
+#include <signal.h>
+#include <poll.h>
 #include <glob.h>
 #include <limits.h>
+#include <module/map.h>
 
 #define CUSTOM_NAME         "Custom"
 #define CUSTOM_ILL_MAX      4096
 #define CUSTOM_ILL_MIN      0
 #define CUSTOM_INTERVAL     20 // ms
 #define CUSTOM_FLD          "/etc/clightd/sensors.d/"
+#define CUSTOM_RING_SIZE    20
+#define CUSTOM_LINE_MAX     64
+#define CUSTOM_TIMEOUT      1000 // ms to wait for first value of a just started stream
 
 #define BUF_LEN (sizeof(struct inotify_event) + NAME_MAX + 1)
 
+typedef struct {
+    int ill;
+    uint64_t ts;                    // CLOCK_MONOTONIC ms it was received
+} custom_value;
+
+typedef struct {
+    char *path;
+    pid_t pid;                      // coprocess pid, 0 for fifos, sockets and files
+    int fd;                         // stream fd, -1 if not running
+    int wd;                         // inotify watch for regular files, -1 if not running
+    custom_value ring[CUSTOM_RING_SIZE]; // last received values
+    int head;
+    int count;
+    char line[CUSTOM_LINE_MAX];     // partially received line
+    size_t len;
+} custom_src;
+
+static bool in_custom_fld(const char *path, char *realp);
+static bool is_stream(const char *path, char *realp);
+static bool is_pseudo_fs(const char *path);
+static int capture_file(const char *path, double *pct, const int num_captures, const double tolerance, int min, int max, int interval);
+static int start_src(custom_src *s);
+static void stop_src(custom_src *s);
+static void read_file(custom_src *s);
+static void recv_file(const struct inotify_event *event);
+static void recv_stream(int fd, void *userdata);
+static void reap_children(int fd, void *userdata);
+static map_ret_code reap_src(void *userptr, const char *key, void *data);
+static map_ret_code find_reaped(void *userptr, const char *key, void *data);
+static void push_value(custom_src *s, int ill);
+static custom_value *last_value(custom_src *s, int idx);
+static uint64_t now_ms(void);
+static void src_dtor(void *data);
+
 SENSOR(CUSTOM_NAME);
 
 static int inot_fd, inot_wd;
+static map_t *srcs;         // sources by path
+static map_t *watches;      // sources by inotify wd
+static map_t *dying;        // killed coprocesses not reaped yet, by pid
 
 static bool validate_dev(void *dev) {
     return true;
@@ -69,28 +138,53 @@ static void destroy_dev(void *dev) {
 }
 
 static int init_monitor(void) {
+    srcs = map_new(true, src_dtor);
+    watches = map_new(true, NULL);
+    dying = map_new(true, free);
     inot_fd = inotify_init();
     inot_wd = inotify_add_watch(inot_fd, CUSTOM_FLD, IN_CREATE | IN_DELETE | IN_MOVE);
+    
+    /* Reap coprocesses without ever blocking on waitpid() */
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    int sig_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (sig_fd == -1 || sensor_register_fd(sig_fd, reap_children, NULL) != 0) {
+        perror("Custom signalfd");
+        if (sig_fd != -1) {
+            close(sig_fd);
+        }
+    }
     return inot_fd;
 }
 
 static void recv_monitor(void **dev) {
     *dev = NULL;
-    char buffer[BUF_LEN];
+    char buffer[BUF_LEN * 8] __attribute__ ((aligned(__alignof__(struct inotify_event))));
 
-    size_t len = read(inot_fd, buffer, BUF_LEN);    
-    if (len > 0) {
-        struct inotify_event *event = (struct inotify_event *)buffer;
-        if (event->len) {
+    ssize_t len = read(inot_fd, buffer, sizeof(buffer));
+    for (char *ptr = buffer; ptr < buffer + len; ) {
+        struct inotify_event *event = (struct inotify_event *)ptr;
+        if (event->wd != inot_wd) {
+            /* A watched sensor file changed */
+            recv_file(event);
+        } else if (event->len && !*dev) {
             /* prepend /etc/clightd/sensors.d/ */
             char fullpath[PATH_MAX + 1] = {0};
             snprintf(fullpath, PATH_MAX, CUSTOM_FLD"%s", event->name);
+            /* Drop any source running on changed file; it will be restarted by next capture */
+            map_remove(srcs, fullpath);
             *dev = strdup(fullpath);
         }
+        ptr += sizeof(struct inotify_event) + event->len;
     }
 }
 
 static void destroy_monitor(void) {
+    map_free(srcs);
+    map_free(watches);
+    map_free(dying);
     inotify_rm_watch(inot_fd, inot_wd);
     close(inot_fd);
 }
@@ -150,27 +244,376 @@ static void parse_settings(char *settings, int *min, int *max, int *interval) {
     }
 }
 
-static int capture(void *dev, double *pct, const int num_captures, char *settings) {
+static int capture(void *dev, double *pct, const int num_captures, const double tolerance, char *settings) {
     int min, max, interval;
     parse_settings(settings, &min, &max, &interval);
+    
+    char realp[PATH_MAX];
+    if (is_pseudo_fs(dev) || !in_custom_fld(dev, realp)) {
+        return capture_file(dev, pct, num_captures, tolerance, min, max, interval);
+    }
 
+    custom_src *s = map_get(srcs, dev);
+    if (!s) {
+        s = calloc(1, sizeof(custom_src));
+        if (!s) {
+            return -ENOMEM;
+        }
+        s->path = strdup(dev);
+        s->fd = -1;
+        s->wd = -1;
+        map_put(srcs, dev, s);
+    }
+    
+    if (s->fd == -1 && s->wd == -1) {
+        int r = start_src(s);
+        if (r < 0) {
+            return r;
+        }
+    }
+    
+    /* Wait for first value of a just started stream */
+    for (int waited = 0; s->fd != -1 && s->count == 0 && waited < CUSTOM_TIMEOUT; waited += CUSTOM_INTERVAL) {
+        struct pollfd p = { .fd = s->fd, .events = POLLIN };
+        if (poll(&p, 1, CUSTOM_INTERVAL) > 0) {
+            recv_stream(s->fd, s);
+        }
+    }
+    
+    /* Return values received during last num_captures intervals, oldest first, or at least last one */
+    const uint64_t now = now_ms();
+    const uint64_t window = (uint64_t)num_captures * interval;
+    const uint64_t since = now > window ? now - window : 0;
     int ctr = 0;
-    FILE *fdev = fopen(dev, "r");
-    if (fdev) {
-        for (int i = 0; i < num_captures; i++) {
-            int ill = -1;
-            if (fscanf(fdev, "%d", &ill) == 1) {
-                if (ill > max) {
-                    ill = max;
-                } else if (ill < min) {
-                    ill = min;
-                }
-                pct[ctr++] = (double)ill / max;
-                rewind(fdev);
+    while (ctr < s->count && ctr < num_captures && last_value(s, ctr)->ts >= since) {
+        ctr++;
+    }
+    if (ctr == 0 && s->count > 0) {
+        ctr = 1;
+    }
+    for (int i = 0; i < ctr; i++) {
+        int ill = last_value(s, ctr - 1 - i)->ill;
+        if (ill > max) {
+            ill = max;
+        } else if (ill < min) {
+            ill = min;
+        }
+        pct[i] = (double)ill / max;
+    }
+    return ctr;
+}
+
+static bool is_pseudo_fs(const char *path) {
+    struct statfs st;
+    return statfs(path, &st) == 0 && (st.f_type == SYSFS_MAGIC || st.f_type == PROC_SUPER_MAGIC);
+}
+
+static int capture_file(const char *path, double *pct, const int num_captures, const double tolerance, int min, int max, int interval) {
+    struct stat st;
+    if (stat(path, &st) == -1) {
+        return -errno;
+    }
+    /* Opening a fifo for reading would block forever */
+    if (!S_ISREG(st.st_mode)) {
+        return -EINVAL;
+    }
+    
+    int ctr = 0;
+    FILE *fdev = fopen(path, "r");
+    if (!fdev) {
+        return -errno;
+    }
+    for (int i = 0; i < num_captures; i++) {
+        int ill = -1;
+        if (fscanf(fdev, "%d", &ill) == 1) {
+            if (ill > max) {
+                ill = max;
+            } else if (ill < min) {
+                ill = min;
             }
+            pct[ctr++] = (double)ill / max;
+            if (sensor_capture_is_stable(pct, ctr, tolerance)) {
+                break;
+            }
+        }
+        rewind(fdev);
+        if (i < num_captures - 1) {
             usleep(interval * 1000);
         }
     }
     fclose(fdev);
     return ctr;
 }
+
+/* Whether path resolves to a file inside CUSTOM_FLD; realp is filled with resolved path */
+static bool in_custom_fld(const char *path, char *realp) {
+    char fld[PATH_MAX];
+    if (!realpath(path, realp) || !realpath(CUSTOM_FLD, fld)) {
+        return false;
+    }
+    const size_t len = strlen(fld);
+    return !strncmp(realp, fld, len) && realp[len] == '/';
+}
+
+/* Streams must live inside CUSTOM_FLD too */
+static bool is_stream(const char *path, char *realp) {
+    if (!in_custom_fld(path, realp)) {
+        return false;
+    }
+    
+    struct stat st;
+    if (stat(realp, &st) == -1) {
+        return false;
+    }
+    return S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode) || 
+            (S_ISREG(st.st_mode) && access(realp, X_OK) == 0);
+}
+
+static int start_src(custom_src *s) {
+    char realp[PATH_MAX];
+    if (!is_stream(s->path, realp)) {
+        struct stat st;
+        if (stat(s->path, &st) == -1) {
+            return -errno;
+        }
+        /* Opening any other fifo for reading would block forever */
+        if (!S_ISREG(st.st_mode)) {
+            return -EINVAL;
+        }
+        
+        /* Regular file: parse it now and then each time it gets written */
+        s->wd = inotify_add_watch(inot_fd, s->path, IN_MODIFY | IN_CLOSE_WRITE);
+        if (s->wd == -1) {
+            perror("Custom watch");
+            return -errno;
+        }
+        char key[16];
+        snprintf(key, sizeof(key), "%d", s->wd);
+        map_put(watches, key, s);
+        read_file(s);
+        return 0;
+    }
+    
+    struct stat st;
+    if (stat(realp, &st) == -1) {
+        return -errno;
+    }
+    
+    int fd = -1;
+    if (S_ISFIFO(st.st_mode)) {
+        /* Open in rw mode: this way the fifo does not hang up when its writers go away */
+        fd = open(realp, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    } else if (S_ISSOCK(st.st_mode)) {
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+        strncpy(addr.sun_path, realp, sizeof(addr.sun_path) - 1);
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd != -1 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+            close(fd);
+            fd = -1;
+        }
+    } else {
+        int pipefd[2];
+        if (pipe2(pipefd, O_CLOEXEC) == -1) {
+            return -errno;
+        }
+        
+        pid_t pid = fork();
+        if (pid == 0) {
+            /* Coprocess: unblock signals blocked by clightd and die with it */
+            sigset_t mask;
+            sigemptyset(&mask);
+            sigprocmask(SIG_SETMASK, &mask, NULL);
+            prctl(PR_SET_PDEATHSIG, SIGTERM);
+            setpgid(0, 0);
+            dup2(pipefd[1], STDOUT_FILENO);
+            execl(realp, realp, NULL);
+            _exit(EXIT_FAILURE);
+        }
+        
+        close(pipefd[1]);
+        if (pid == -1) {
+            close(pipefd[0]);
+            return -EAGAIN;
+        }
+        /* Set it from parent side too: group must exist before we may kill it */
+        setpgid(pid, pid);
+        s->pid = pid;
+        fd = pipefd[0];
+    }
+    
+    if (fd == -1) {
+        perror("Custom stream");
+        return -errno;
+    }
+    
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    int r = sensor_register_fd(fd, recv_stream, s);
+    if (r == 0) {
+        s->fd = fd;
+    } else {
+        close(fd);
+        stop_src(s);
+    }
+    return r;
+}
+
+static void stop_src(custom_src *s) {
+    if (s->wd != -1) {
+        char key[16];
+        snprintf(key, sizeof(key), "%d", s->wd);
+        map_remove(watches, key);
+        inotify_rm_watch(inot_fd, s->wd);
+        s->wd = -1;
+    }
+    if (s->fd != -1) {
+        sensor_deregister_fd(s->fd); // this will close fd
+        s->fd = -1;
+    }
+    if (s->pid > 0) {
+        /* Kill whole coprocess group, eg: any pipeline started by a script; it is reaped on SIGCHLD */
+        kill(-s->pid, SIGKILL);
+        pid_t *pid = malloc(sizeof(pid_t));
+        if (waitpid(s->pid, NULL, WNOHANG) == 0 && pid) {
+            char key[16];
+            snprintf(key, sizeof(key), "%d", s->pid);
+            *pid = s->pid;
+            map_put(dying, key, pid);
+        } else {
+            free(pid);
+        }
+        s->pid = 0;
+    }
+    /* Drop stale values */
+    s->head = 0;
+    s->count = 0;
+    s->len = 0;
+}
+
+static void read_file(custom_src *s) {
+    FILE *f = fopen(s->path, "r");
+    if (f) {
+        int ill;
+        if (fscanf(f, "%d", &ill) == 1) {
+            /* Writers may trigger multiple events for same value (eg: IN_MODIFY then IN_CLOSE_WRITE): just refresh it */
+            if (s->count > 0 && last_value(s, 0)->ill == ill) {
+                last_value(s, 0)->ts = now_ms();
+            } else {
+                push_value(s, ill);
+            }
+        }
+        fclose(f);
+    }
+}
+
+static void recv_file(const struct inotify_event *event) {
+    char key[16];
+    snprintf(key, sizeof(key), "%d", event->wd);
+    custom_src *s = map_get(watches, key);
+    if (s) {
+        if (event->mask & IN_IGNORED) {
+            /* Watched file is gone (or replaced); it will be watched again by next capture */
+            char path[PATH_MAX + 1] = {0};
+            strncpy(path, s->path, PATH_MAX);
+            map_remove(srcs, path);
+        } else {
+            read_file(s);
+        }
+    }
+}
+
+static void recv_stream(int fd, void *userdata) {
+    custom_src *s = (custom_src *)userdata;
+    
+    char buf[256];
+    ssize_t len;
+    while ((len = read(fd, buf, sizeof(buf))) > 0) {
+        for (int i = 0; i < len; i++) {
+            if (buf[i] == '\n') {
+                int ill;
+                s->line[s->len] = '\0';
+                if (sscanf(s->line, "%d", &ill) == 1) {
+                    push_value(s, ill);
+                }
+                s->len = 0;
+            } else if (s->len < CUSTOM_LINE_MAX - 1) {
+                s->line[s->len++] = buf[i];
+            }
+        }
+    }
+    
+    if (len == 0 || (errno != EAGAIN && errno != EINTR)) {
+        /* Stream closed; it will be restarted by next capture */
+        fprintf(stderr, "Custom stream closed.\n");
+        stop_src(s);
+    }
+}
+
+static void reap_children(int fd, void *userdata) {
+    struct signalfd_siginfo fdsi;
+    while (read(fd, &fdsi, sizeof(fdsi)) == sizeof(fdsi));
+    
+    /* Only wait on our own coprocesses: other modules may wait on their children */
+    map_iterate(srcs, reap_src, NULL);
+    char key[16];
+    while (map_iterate(dying, find_reaped, key) == MAP_FULL) {
+        map_remove(dying, key);
+    }
+}
+
+static map_ret_code reap_src(void *userptr, const char *key, void *data) {
+    custom_src *s = (custom_src *)data;
+    if (s->pid > 0 && waitpid(s->pid, NULL, WNOHANG) == s->pid) {
+        /* Never kill a reused pid: stream gets closed and restarted anyway */
+        s->pid = 0;
+    }
+    return MAP_OK;
+}
+
+static map_ret_code find_reaped(void *userptr, const char *key, void *data) {
+    const pid_t *pid = (const pid_t *)data;
+    if (waitpid(*pid, NULL, WNOHANG) != 0) {
+        /* Return its key through userptr */
+        snprintf(userptr, 16, "%s", key);
+        return MAP_FULL; // break iteration
+    }
+    return MAP_OK;
+}
+
+static void push_value(custom_src *s, int ill) {
+    const bool changed = s->count == 0 || last_value(s, 0)->ill != ill;
+    
+    s->ring[s->head].ill = ill;
+    s->ring[s->head].ts = now_ms();
+    s->head = (s->head + 1) % CUSTOM_RING_SIZE;
+    if (s->count < CUSTOM_RING_SIZE) {
+        s->count++;
+    }
+    
+    if (changed) {
+        /* Signal is emitted with default min and max values */
+        if (ill > CUSTOM_ILL_MAX) {
+            ill = CUSTOM_ILL_MAX;
+        } else if (ill < CUSTOM_ILL_MIN) {
+            ill = CUSTOM_ILL_MIN;
+        }
+        sensor_emit_value(CUSTOM_NAME, s->path, (double)ill / CUSTOM_ILL_MAX);
+    }
+}
+
+/* idx-th last received value, 0 being the newest */
+static custom_value *last_value(custom_src *s, int idx) {
+    return &s->ring[(s->head - 1 - idx + 2 * CUSTOM_RING_SIZE) % CUSTOM_RING_SIZE];
+}
+
+static uint64_t now_ms(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000 + t.tv_nsec / 1000000;
+}
+
+static void src_dtor(void *data) {
+    custom_src *s = (custom_src *)data;
+    stop_src(s);
+    free(s->path);
+    free(s);
+}
@@ -381,7 +381,7 @@ static int destroy_usb_device(void) {
     return ret;
 }
 
-static int capture(void *dev, double *pct, const int num_captures, char *settings) {
+static int capture(void *dev, double *pct, const int num_captures, const double tolerance, char *settings) {
     int min, max, interval;
     parse_settings(settings, &min, &max, &interval);
     int ctr = -ENODEV;
@@ -401,6 +401,9 @@ static int capture(void *dev, double *pct, const int num_captures, char *setting
                     illuminance = min;
                 }
                 pct[ctr++] = illuminance / max;
+                if (sensor_capture_is_stable(pct, ctr, tolerance)) {
+                    break;
+                }
             }
         }
         destroy_usb_device();
@@ -1,7 +1,8 @@
-#if defined GAMMA_PRESENT || defined DPMS_PRESENT
+#if defined GAMMA_PRESENT || defined DPMS_PRESENT || defined SCREEN_PRESENT
 
 #include "drm_utils.h"
 #include "commons.h"
+#include <dirent.h>
 
 #define DEFAULT_DRM "/dev/dri/card0"
 
@@ -16,4 +17,76 @@ int drm_open_card(const char *card) {
     return fd;
 }
 
+/* Same names as kernel ones, eg: DP-1, as used by sysfs and most compositors (not by Xorg DDX drivers) */
+void drm_connector_name(const drmModeConnector *conn, char *name, const size_t size) {
+    static const char *types[] = {
+        "Unknown", "VGA", "DVI-I", "DVI-D", "DVI-A", "Composite", "SVIDEO", "LVDS", "Component",
+        "DIN", "DP", "HDMI-A", "HDMI-B", "TV", "eDP", "Virtual", "DSI", "DPI", "Writeback", "SPI", "USB"
+    };
+    const char *type = conn->connector_type < SIZE(types) ? types[conn->connector_type] : types[0];
+    snprintf(name, size, "%s-%u", type, conn->connector_type_id);
+}
+
+/* Whether connector is driving a crtc with a width x height mode */
+static bool connector_drives_mode(const int fd, const drmModeConnector *conn, const uint32_t width, const uint32_t height) {
+    bool ret = false;
+    drmModeEncoder *enc = conn->encoder_id ? drmModeGetEncoder(fd, conn->encoder_id) : NULL;
+    if (enc) {
+        drmModeCrtc *crtc = enc->crtc_id ? drmModeGetCrtc(fd, enc->crtc_id) : NULL;
+        if (crtc) {
+            ret = crtc->mode_valid && crtc->mode.hdisplay == width && crtc->mode.vdisplay == height;
+            drmModeFreeCrtc(crtc);
+        }
+        drmModeFreeEncoder(enc);
+    }
+    return ret;
+}
+
+/*
+ * Kernel name of a connector known by its id only (eg: Xorg RandR CONNECTOR_ID output property).
+ * Ids are only unique per card: look for it on every card (numbering may have gaps),
+ * keeping the one currently driving a width x height mode, like the X output does.
+ * Returns -ENOTUNIQ if more than one card matches.
+ */
+int drm_find_connector_name(const uint32_t conn_id, const uint32_t width, const uint32_t height,
+                            char *name, const size_t size) {
+    DIR *d = opendir("/dev/dri");
+    if (!d) {
+        return -errno;
+    }
+    
+    int ret = -ENOENT;
+    struct dirent *e;
+    while (ret != -ENOTUNIQ && (e = readdir(d))) {
+        if (strncmp(e->d_name, "card", 4)) {
+            continue;
+        }
+        
+        char card[PATH_MAX];
+        snprintf(card, sizeof(card), "/dev/dri/%s", e->d_name);
+        int fd = open(card, O_RDWR | O_CLOEXEC);
+        if (fd < 0) {
+            continue;
+        }
+        drmModeConnector *conn = drmModeGetConnectorCurrent(fd, conn_id);
+        if (conn) {
+            if (connector_drives_mode(fd, conn, width, height)) {
+                if (ret == 0) {
+                    ret = -ENOTUNIQ;
+                } else {
+                    drm_connector_name(conn, name, size);
+                    ret = 0;
+                }
+            }
+            drmModeFreeConnector(conn);
+        }
+        close(fd);
+    }
+    closedir(d);
+    if (ret == -ENOTUNIQ) {
+        name[0] = '\0';
+    }
+    return ret;
+}
+
 #endif
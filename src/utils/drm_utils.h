@@ -2,3 +2,6 @@
 #include <xf86drmMode.h>
 
 int drm_open_card(const char *card_num);
+void drm_connector_name(const drmModeConnector *conn, char *name, const size_t size);
+int drm_find_connector_name(const uint32_t conn_id, const uint32_t width, const uint32_t height,
+                            char *name, const size_t size);
@@ -0,0 +1,431 @@
+#include "frame_utils.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#include <immintrin.h>
+#endif
+
+#define LUMA(r, g, b)   ((299 * (r) + 587 * (g) + 114 * (b)) / 1000)
+
+typedef struct {
+    const frame_t *f;
+    int xstep;
+    int ystep;
+    int row_start;      // first sampled row index
+    int row_end;        // last (excluded) sampled row index
+    uint8_t *luma;      // luminance of each sample, if requested
+    uint64_t sum[3];    // r, g, b
+    pthread_t thread;
+} frame_job;
+
+static const int bpps[] = { 4, 4, 2, 3, 4 };
+
+/*
+ * Sums are kept in locals: written through sum pointer, they would be reloaded
+ * and stored back on each pixel, as luma (uint8_t *) may alias them.
+ * Loop is duplicated so that the luma check is not done per pixel.
+ */
+#define SUM_ROW(bpp, decode) \
+    do { \
+        uint64_t sr = 0, sg = 0, sb = 0; \
+        const uint8_t *p = row; \
+        const uint8_t *end = row + (size_t)f->width * bpp; \
+        const size_t inc = (size_t)xstep * bpp; \
+        if (luma) { \
+            for (; p < end; p += inc) { \
+                uint32_t r, g, b; \
+                decode; \
+                sr += r; \
+                sg += g; \
+                sb += b; \
+                *luma++ = LUMA(r, g, b); \
+            } \
+        } else { \
+            for (; p < end; p += inc) { \
+                uint32_t r, g, b; \
+                decode; \
+                sr += r; \
+                sg += g; \
+                sb += b; \
+            } \
+        } \
+        sum[0] += sr; \
+        sum[1] += sg; \
+        sum[2] += sb; \
+    } while (0)
+
+static void sum_row(const frame_t *f, const uint8_t *row, const int xstep, uint64_t sum[3], uint8_t *luma) {
+    switch (f->fmt) {
+    case FRAME_XRGB8888:
+        SUM_ROW(4, b = p[0]; g = p[1]; r = p[2]);
+        break;
+    case FRAME_XBGR8888:
+        SUM_ROW(4, r = p[0]; g = p[1]; b = p[2]);
+        break;
+    case FRAME_RGB888:
+        SUM_ROW(3, b = p[0]; g = p[1]; r = p[2]);
+        break;
+    case FRAME_RGB565:
+        /* Expand 5/6 bits channels to 8 bits */
+        SUM_ROW(2, const uint32_t v = p[0] | p[1] << 8;
+                r = (v >> 11) & 0x1F; r = (r << 3) | (r >> 2);
+                g = (v >> 5) & 0x3F; g = (g << 2) | (g >> 4);
+                b = v & 0x1F; b = (b << 3) | (b >> 2));
+        break;
+    case FRAME_XRGB2101010:
+        /* Keep 8 most significant bits of each channel */
+        SUM_ROW(4, const uint32_t v = p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+                r = (v >> 22) & 0xFF;
+                g = (v >> 12) & 0xFF;
+                b = (v >> 2) & 0xFF);
+        break;
+    }
+}
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define FRAME_SIMD
+
+static bool has_avx2;
+
+/* Once, before any job thread may read it */
+static void __attribute__((constructor)) init_cpu_features(void) {
+    __builtin_cpu_init(); // needed when called from a constructor
+    has_avx2 = __builtin_cpu_supports("avx2");
+}
+
+/*
+ * Sum bytes 0, 1 and 2 of each 32bpp pixel of a row:
+ * mask out other bytes and let psadbw sum them horizontally into 64b lanes.
+ */
+static void sum_row_sse2(const uint8_t *row, const int width, uint64_t sum[3]) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i m[3] = { _mm_set1_epi32(0xFF), _mm_set1_epi32(0xFF00), _mm_set1_epi32(0xFF0000) };
+    __m128i acc[3] = { zero, zero, zero };
+    
+    int x = 0;
+    for (; x + 4 <= width; x += 4) {
+        const __m128i v = _mm_loadu_si128((const __m128i *)(row + x * 4));
+        for (int c = 0; c < 3; c++) {
+            acc[c] = _mm_add_epi64(acc[c], _mm_sad_epu8(_mm_and_si128(v, m[c]), zero));
+        }
+    }
+    for (int c = 0; c < 3; c++) {
+        uint64_t t[2];
+        _mm_storeu_si128((__m128i *)t, acc[c]);
+        sum[c] += t[0] + t[1];
+        for (int i = x; i < width; i++) {
+            sum[c] += row[i * 4 + c];
+        }
+    }
+}
+
+__attribute__((target("avx2")))
+static void sum_row_avx2(const uint8_t *row, const int width, uint64_t sum[3]) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i m[3] = { _mm256_set1_epi32(0xFF), _mm256_set1_epi32(0xFF00), _mm256_set1_epi32(0xFF0000) };
+    __m256i acc[3] = { zero, zero, zero };
+    
+    int x = 0;
+    for (; x + 8 <= width; x += 8) {
+        const __m256i v = _mm256_loadu_si256((const __m256i *)(row + x * 4));
+        for (int c = 0; c < 3; c++) {
+            acc[c] = _mm256_add_epi64(acc[c], _mm256_sad_epu8(_mm256_and_si256(v, m[c]), zero));
+        }
+    }
+    for (int c = 0; c < 3; c++) {
+        uint64_t t[4];
+        _mm256_storeu_si256((__m256i *)t, acc[c]);
+        sum[c] += t[0] + t[1] + t[2] + t[3];
+        for (int i = x; i < width; i++) {
+            sum[c] += row[i * 4 + c];
+        }
+    }
+}
+#endif
+
+static void *run_job(void *data) {
+    frame_job *job = (frame_job *)data;
+    const frame_t *f = job->f;
+    
+#ifdef FRAME_SIMD
+    /* Whole rows of 8 bits per channel pixels: use SIMD */
+    if (!job->luma && job->xstep == 1 && (f->fmt == FRAME_XRGB8888 || f->fmt == FRAME_XBGR8888)) {
+        uint64_t sum[3] = {0};
+        for (int y = job->row_start; y < job->row_end; y++) {
+            const uint8_t *row = f->data + (size_t)y * job->ystep * f->stride;
+            if (has_avx2) {
+                sum_row_avx2(row, f->width, sum);
+            } else {
+                sum_row_sse2(row, f->width, sum);
+            }
+        }
+        /* Byte 0 is blue for XRGB, red for XBGR */
+        const int r = f->fmt == FRAME_XRGB8888 ? 2 : 0;
+        job->sum[0] += sum[r];
+        job->sum[1] += sum[1];
+        job->sum[2] += sum[2 - r];
+        return NULL;
+    }
+#endif
+    
+    const int cols = (f->width + job->xstep - 1) / job->xstep;
+    for (int y = job->row_start; y < job->row_end; y++) {
+        const uint8_t *row = f->data + (size_t)y * job->ystep * f->stride;
+        sum_row(f, row, job->xstep, job->sum, job->luma ? job->luma + (size_t)(y - job->row_start) * cols : NULL);
+    }
+    return NULL;
+}
+
+/* Bytes per pixel */
+int frame_bpp(const enum frame_formats fmt) {
+    return bpps[fmt];
+}
+
+/*
+ * Compute average luminance (0-255) of a frame, sampling one pixel every xstep
+ * on one row every ystep, traversing it row by row.
+ * If ex is set, it is filled with histogram of sampled pixels (using a square grid).
+ * Returns a -errno style error on failure.
+ */
+int frame_brightness(const frame_t *f, int xstep, int ystep, frame_export *ex) {
+    if (xstep < 1) {
+        xstep = 1;
+    }
+    if (ystep < 1) {
+        ystep = 1;
+    }
+    if (ex) {
+        /* Keep exported frame aspect ratio */
+        xstep = ystep = xstep > ystep ? xstep : ystep;
+    }
+    if (f->width * bpps[f->fmt] > f->stride) {
+        return -EINVAL;
+    }
+    
+    const int cols = (f->width + xstep - 1) / xstep;
+    const int rows = (f->height + ystep - 1) / ystep;
+    if (cols <= 0 || rows <= 0) {
+        return 0;
+    }
+    
+    uint8_t *luma = NULL;
+    if (ex) {
+        luma = malloc((size_t)cols * rows);
+        if (!luma) {
+            return -ENOMEM;
+        }
+    }
+    
+    /* Big frames are split across threads, unless a histogram was requested */
+    int num_jobs = 1;
+    if (!ex && (long)f->width * f->height > FRAME_MT_PIXELS) {
+        num_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+        if (num_jobs > FRAME_MT_MAX) {
+            num_jobs = FRAME_MT_MAX;
+        } else if (num_jobs < 1) {
+            num_jobs = 1;
+        }
+    }
+    
+    frame_job jobs[FRAME_MT_MAX] = {{0}};
+    bool threaded[FRAME_MT_MAX] = {0};
+    for (int i = 0; i < num_jobs; i++) {
+        jobs[i].f = f;
+        jobs[i].xstep = xstep;
+        jobs[i].ystep = ystep;
+        jobs[i].row_start = rows * i / num_jobs;
+        jobs[i].row_end = rows * (i + 1) / num_jobs;
+        jobs[i].luma = luma;
+        /* Calling thread runs first job itself */
+        if (i > 0) {
+            threaded[i] = pthread_create(&jobs[i].thread, NULL, run_job, &jobs[i]) == 0;
+        }
+    }
+    
+    uint64_t sum[3] = {0};
+    for (int i = 0; i < num_jobs; i++) {
+        if (threaded[i]) {
+            pthread_join(jobs[i].thread, NULL);
+        } else {
+            run_job(&jobs[i]);
+        }
+        for (int c = 0; c < 3; c++) {
+            sum[c] += jobs[i].sum[c];
+        }
+    }
+    
+    if (luma) {
+        frame_export_luma(ex, luma, cols, rows, 1);
+        free(luma);
+    }
+    
+    const uint64_t count = (uint64_t)cols * rows;
+    return LUMA(sum[0] / count, sum[1] / count, sum[2] / count);
+}
+
+/*
+ * Recompute sums of tiles intersecting the damaged rectangle (in frame coordinates).
+ * Everything is recomputed if frame size changed. Rows are sampled every ystep,
+ * relative to each tile origin: FRAME_TILE_SIZE should be a multiple of it.
+ */
+int frame_tiles_update(frame_tiles *t, const frame_t *f, int ystep, int x, int y, int w, int h) {
+    if (f->width * bpps[f->fmt] > f->stride) {
+        return -EINVAL;
+    }
+    if (ystep < 1) {
+        ystep = 1;
+    }
+    
+    if (t->width != f->width || t->height != f->height) {
+        frame_tiles_free(t);
+        t->cols = (f->width + FRAME_TILE_SIZE - 1) / FRAME_TILE_SIZE;
+        t->rows = (f->height + FRAME_TILE_SIZE - 1) / FRAME_TILE_SIZE;
+        t->sums = calloc((size_t)t->cols * t->rows, sizeof(*t->sums));
+        t->counts = calloc((size_t)t->cols * t->rows, sizeof(*t->counts));
+        if (!t->sums || !t->counts) {
+            frame_tiles_free(t);
+            return -ENOMEM;
+        }
+        t->width = f->width;
+        t->height = f->height;
+        x = y = 0;
+        w = f->width;
+        h = f->height;
+    }
+    
+    /* Clip to frame */
+    if (x < 0) {
+        w += x;
+        x = 0;
+    }
+    if (y < 0) {
+        h += y;
+        y = 0;
+    }
+    if (x + w > f->width) {
+        w = f->width - x;
+    }
+    if (y + h > f->height) {
+        h = f->height - y;
+    }
+    if (w <= 0 || h <= 0) {
+        return 0;
+    }
+    
+    const int bpp = bpps[f->fmt];
+    for (int ty = y / FRAME_TILE_SIZE; ty <= (y + h - 1) / FRAME_TILE_SIZE; ty++) {
+        for (int tx = x / FRAME_TILE_SIZE; tx <= (x + w - 1) / FRAME_TILE_SIZE; tx++) {
+            const int x0 = tx * FRAME_TILE_SIZE;
+            const int y0 = ty * FRAME_TILE_SIZE;
+            frame_t tile = *f;
+            tile.data = f->data + (size_t)y0 * f->stride + x0 * bpp;
+            tile.width = x0 + FRAME_TILE_SIZE > f->width ? f->width - x0 : FRAME_TILE_SIZE;
+            tile.height = y0 + FRAME_TILE_SIZE > f->height ? f->height - y0 : FRAME_TILE_SIZE;
+            
+            frame_job job = { .f = &tile, .xstep = 1, .ystep = ystep };
+            job.row_end = (tile.height + ystep - 1) / ystep;
+            run_job(&job);
+            
+            const int idx = ty * t->cols + tx;
+            memcpy(t->sums[idx], job.sum, sizeof(job.sum));
+            t->counts[idx] = (uint32_t)tile.width * job.row_end;
+        }
+    }
+    return 0;
+}
+
+/* Average luminance (0-255) of all tiles, or -EINVAL if none was computed */
+int frame_tiles_brightness(const frame_tiles *t) {
+    uint64_t sum[3] = {0};
+    uint64_t count = 0;
+    for (int i = 0; i < t->cols * t->rows; i++) {
+        for (int c = 0; c < 3; c++) {
+            sum[c] += t->sums[i][c];
+        }
+        count += t->counts[i];
+    }
+    if (count == 0) {
+        return -EINVAL;
+    }
+    return LUMA(sum[0] / count, sum[1] / count, sum[2] / count);
+}
+
+void frame_tiles_free(frame_tiles *t) {
+    free(t->sums);
+    free(t->counts);
+    memset(t, 0, sizeof(frame_tiles));
+}
+
+/*
+ * Fill histogram (and frame, if requested) from a 8-bit luminance buffer.
+ * inc is the distance in bytes between two pixels, eg: 2 for YUYV.
+ */
+void frame_export_luma(frame_export *ex, const uint8_t *luma, const int width, const int height, const int inc) {
+    memset(ex->hist, 0, sizeof(ex->hist));
+    for (int i = 0; i < width * height; i++) {
+        ex->hist[luma[i * inc]]++;
+    }
+    
+    if (ex->with_frame) {
+        /* Downscale frame, taking 1 pixel every step*step area */
+        const int step = width > FRAME_EXPORT_W ? (width + FRAME_EXPORT_W - 1) / FRAME_EXPORT_W : 1;
+        ex->width = width / step;
+        ex->height = height / step;
+        free(ex->frame);
+        ex->frame = malloc(ex->width * ex->height);
+        if (ex->frame) {
+            for (uint32_t y = 0; y < ex->height; y++) {
+                for (uint32_t x = 0; x < ex->width; x++) {
+                    ex->frame[y * ex->width + x] = luma[(y * step * width + x * step) * inc];
+                }
+            }
+        } else {
+            ex->width = 0;
+            ex->height = 0;
+        }
+    }
+    ex->filled = true;
+}
+
+/* Turn exported frame upside down, eg: for bottom-up source buffers */
+void frame_export_flip(frame_export *ex) {
+    if (!ex->frame) {
+        return;
+    }
+    for (uint32_t y = 0; y < ex->height / 2; y++) {
+        uint8_t *top = ex->frame + y * ex->width;
+        uint8_t *bottom = ex->frame + (ex->height - 1 - y) * ex->width;
+        for (uint32_t x = 0; x < ex->width; x++) {
+            const uint8_t t = top[x];
+            top[x] = bottom[x];
+            bottom[x] = t;
+        }
+    }
+}
+
+/* Returns a sealed memfd, or -errno on error */
+int frame_export_to_memfd(const frame_export *ex) {
+    int fd = memfd_create("clightd-frame", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) {
+        return -errno;
+    }
+    
+    const uint32_t dims[2] = { ex->frame ? ex->width : 0, ex->frame ? ex->height : 0 };
+    const size_t frame_size = dims[0] * dims[1];
+    if (write(fd, dims, sizeof(dims)) != sizeof(dims) || 
+        write(fd, ex->hist, sizeof(ex->hist)) != sizeof(ex->hist) || 
+        (frame_size && write(fd, ex->frame, frame_size) != (ssize_t)frame_size) || 
+        fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) == -1) {
+        
+        int ret = -errno;
+        close(fd);
+        return ret ? ret : -EIO;
+    }
+    lseek(fd, 0, SEEK_SET);
+    return fd;
+}
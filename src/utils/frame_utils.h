@@ -0,0 +1,68 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define FRAME_HIST_BINS     256
+#define FRAME_EXPORT_W      160     // max width of exported greyscale frames
+
+/*
+ * Default sampling grid: whole rows (SIMD summed) every 32, ie: twice the samples of legacy 8x8 grid,
+ * laid out differently. Scalar 8x8 grid is faster than legacy kernel too, see bench/.
+ */
+#define FRAME_DEF_XSTEP     1
+#define FRAME_DEF_YSTEP     32
+#define FRAME_MT_PIXELS     (3840 * 2160)   // frames bigger than this are split across threads
+#define FRAME_MT_MAX        4
+#define FRAME_TILE_SIZE     64      // side of tiles whose luminance sums are kept between damage updates
+
+/*
+ * Supported pixel formats, with same meaning as their DRM fourcc counterparts,
+ * ie: little endian packed pixels; eg: XRGB8888 is B, G, R, X in memory.
+ */
+enum frame_formats { FRAME_XRGB8888, FRAME_XBGR8888, FRAME_RGB565, FRAME_RGB888, FRAME_XRGB2101010 };
+
+typedef struct {
+    const uint8_t *data;
+    int width;
+    int height;
+    int stride;     // in bytes
+    enum frame_formats fmt;
+} frame_t;
+
+/*
+ * Luminance histogram and optional downscaled greyscale frame.
+ * They are exported to clients as a sealed memfd, with layout (native endianness):
+ * uint32_t width, uint32_t height, uint32_t hist[FRAME_HIST_BINS], uint8_t frame[width * height].
+ * Width and height are 0 if no frame was requested.
+ */
+typedef struct {
+    bool with_frame;        // whether a greyscale frame was requested
+    bool filled;            // set once histogram has been computed
+    uint32_t width;
+    uint32_t height;
+    uint32_t hist[FRAME_HIST_BINS];
+    uint8_t *frame;
+} frame_export;
+
+/*
+ * Per-tile r, g, b sums of a frame, so that only damaged tiles
+ * need to be recomputed when watching screen content.
+ */
+typedef struct {
+    int width;              // frame size tiles refer to
+    int height;
+    int cols;
+    int rows;
+    uint64_t (*sums)[3];
+    uint32_t *counts;       // number of samples of each tile
+} frame_tiles;
+
+int frame_bpp(const enum frame_formats fmt);
+int frame_brightness(const frame_t *f, int xstep, int ystep, frame_export *ex);
+int frame_tiles_update(frame_tiles *t, const frame_t *f, int ystep, int x, int y, int w, int h);
+int frame_tiles_brightness(const frame_tiles *t);
+void frame_tiles_free(frame_tiles *t);
+void frame_export_luma(frame_export *ex, const uint8_t *luma, const int width, const int height, const int inc);
+void frame_export_flip(frame_export *ex);
+int frame_export_to_memfd(const frame_export *ex);